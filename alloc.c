@@ -0,0 +1,308 @@
+/**
+ * Allocation profiler.
+ *
+ * Every allocation made through the wrappers is kept in an open-addressing
+ * hash table keyed by its address, along with its size and the call site it
+ * came from, so that freeing it can be credited back to the right site. The
+ * table itself is allocated with the real allocator and isn't counted.
+ *
+ * Call sites are identified by the address of their (string literal) tag,
+ * so looking one up is a pointer comparison rather than a string one.
+ */
+#ifdef ALLOC_PROFILE
+
+#include <assert.h>
+#include <stdint.h>
+
+#define ALLOC_NO_WRAP
+#include "alloc.h"
+
+/** Statistics for a single call site. */
+struct alloc_site {
+  const char *tag;          /* "file:line", or NULL for the overflow site. */
+  unsigned long allocs;     /* Number of allocations made. */
+  size_t bytes;             /* Total bytes allocated. */
+  unsigned long live;       /* Number of allocations not freed yet. */
+  size_t live_bytes;        /* Bytes not freed yet. */
+};
+
+/** A live allocation. */
+struct alloc_entry {
+  void *ptr;                /* The allocation (NULL if the slot is empty). */
+  size_t size;              /* Its size. */
+  unsigned int site;        /* Index of the site it came from. */
+};
+
+static struct alloc_site sites[ALLOC_MAX_SITES + 1];
+static unsigned int num_sites = 0;
+
+static struct alloc_entry *entries = NULL;
+static size_t capacity = 0;
+static size_t used = 0;
+
+static size_t live_bytes = 0;     /* Bytes currently allocated. */
+static unsigned long live = 0;    /* Allocations currently live. */
+static size_t peak_bytes = 0;     /* Highest live_bytes seen. */
+
+static unsigned long lines = 0;   /* Lines executed. */
+static unsigned long total_allocs = 0;
+static size_t total_bytes = 0;
+
+/* Totals at the end of the line before last, so the last line's share can be
+ * reported on its own. */
+static unsigned long line_start_allocs = 0, last_line_allocs = 0;
+static size_t line_start_bytes = 0, last_line_bytes = 0;
+
+// Find the index of the site with the given tag, adding it if it's new
+static unsigned int find_site(const char *tag) {
+  for (unsigned int i = 0; i < num_sites; i++) {
+    if (sites[i].tag == tag) {
+      return i;
+    }
+  }
+  if (num_sites == ALLOC_MAX_SITES) {
+    // out of room, so this one goes to the overflow site at the end
+    return ALLOC_MAX_SITES;
+  }
+  sites[num_sites].tag = tag;
+  return num_sites++;
+}
+
+// The slot a pointer hashes to (the table's capacity is a power of two)
+static size_t slot_of(void *ptr) {
+  uint64_t h = (uintptr_t)ptr;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h & (capacity - 1);
+}
+
+// Find the slot holding ptr, or the empty slot it would go in
+static size_t find_slot(void *ptr) {
+  size_t idx = slot_of(ptr);
+  while (entries[idx].ptr != NULL && entries[idx].ptr != ptr) {
+    idx = (idx + 1) & (capacity - 1);
+  }
+  return idx;
+}
+
+// Double the size of the table (or create it)
+static void grow(void) {
+  struct alloc_entry *old = entries;
+  size_t old_capacity = capacity;
+
+  capacity = capacity ? capacity * 2 : ALLOC_INITIAL_SLOTS;
+  entries = (struct alloc_entry *)calloc(capacity, sizeof(struct alloc_entry));
+  assert(entries != NULL);
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].ptr != NULL) {
+      entries[find_slot(old[i].ptr)] = old[i];
+    }
+  }
+  free(old);
+}
+
+// Remove the given allocation from the table, crediting its site, and copy
+// its entry to *removed (if that isn't NULL). Returns 0 if ptr wasn't
+// allocated through us.
+static int forget(void *ptr, struct alloc_entry *removed) {
+  if (ptr == NULL || capacity == 0) {
+    return 0;
+  }
+  size_t idx = find_slot(ptr);
+  if (entries[idx].ptr == NULL) {
+    return 0;
+  }
+
+  if (removed != NULL) {
+    *removed = entries[idx];
+  }
+  struct alloc_site *s = &sites[entries[idx].site];
+  s->live--;
+  s->live_bytes -= entries[idx].size;
+  live--;
+  live_bytes -= entries[idx].size;
+  entries[idx].ptr = NULL;
+  used--;
+
+  // shift the entries that follow back into the gap, so that probing never
+  // has to skip over removed slots
+  size_t gap = idx;
+  size_t next = (idx + 1) & (capacity - 1);
+  while (entries[next].ptr != NULL) {
+    size_t home = slot_of(entries[next].ptr);
+    // the entry can move into the gap unless its home slot lies cyclically
+    // in (gap, next]
+    if (((next - home) & (capacity - 1)) >= ((next - gap) & (capacity - 1))) {
+      entries[gap] = entries[next];
+      entries[next].ptr = NULL;
+      gap = next;
+    }
+    next = (next + 1) & (capacity - 1);
+  }
+  return 1;
+}
+
+// Put back an allocation that forget removed, as if it never had
+static void restore(const struct alloc_entry *entry) {
+  if ((used + 1) * 2 > capacity) {
+    grow();
+  }
+  entries[find_slot(entry->ptr)] = *entry;
+  used++;
+
+  struct alloc_site *s = &sites[entry->site];
+  s->live++;
+  s->live_bytes += entry->size;
+  live++;
+  live_bytes += entry->size;
+}
+
+// Add a new allocation to the table, charging it to the given site
+static void remember(void *ptr, size_t size, const char *tag) {
+  if (ptr == NULL) {
+    return;
+  }
+  // memory we handed out may have been freed by code we don't see, in
+  // which case the allocator is free to hand its address out again
+  forget(ptr, NULL);
+
+  if ((used + 1) * 2 > capacity) {
+    grow();
+  }
+  size_t idx = find_slot(ptr);
+  unsigned int site = find_site(tag);
+  entries[idx].ptr = ptr;
+  entries[idx].size = size;
+  entries[idx].site = site;
+  used++;
+
+  struct alloc_site *s = &sites[site];
+  s->allocs++;
+  s->bytes += size;
+  s->live++;
+  s->live_bytes += size;
+  total_allocs++;
+  total_bytes += size;
+  live++;
+  live_bytes += size;
+  if (live_bytes > peak_bytes) {
+    peak_bytes = live_bytes;
+  }
+}
+
+/** malloc, recording the allocation against the given site. */
+void *alloc_malloc(size_t size, const char *site) {
+  void *ptr = malloc(size);
+  remember(ptr, size, site);
+  return ptr;
+}
+
+/** calloc, recording the allocation against the given site. */
+void *alloc_calloc(size_t n, size_t size, const char *site) {
+  void *ptr = calloc(n, size);
+  remember(ptr, n * size, site);
+  return ptr;
+}
+
+/** realloc, recording the new allocation against the given site. */
+void *alloc_realloc(void *ptr, size_t size, const char *site) {
+  // ptr can't be looked at once realloc has freed it, so it's forgotten
+  // first (and put back if realloc fails)
+  struct alloc_entry old;
+  int tracked = forget(ptr, &old);
+  void *resized = realloc(ptr, size);
+  if (resized == NULL && size != 0) {
+    // the old allocation is still there
+    if (tracked) {
+      restore(&old);
+    }
+    return NULL;
+  }
+  remember(resized, size, site);
+  return resized;
+}
+
+/** strdup, recording the copy against the given site. */
+char *alloc_strdup(const char *str, const char *site) {
+  char *copy = strdup(str);
+  remember(copy, strlen(str) + 1, site);
+  return copy;
+}
+
+/** strndup, recording the copy against the given site. */
+char *alloc_strndup(const char *str, size_t n, const char *site) {
+  char *copy = strndup(str, n);
+  if (copy != NULL) {
+    remember(copy, strlen(copy) + 1, site);
+  }
+  return copy;
+}
+
+/** free. */
+void alloc_free(void *ptr) {
+  forget(ptr, NULL);
+  free(ptr);
+}
+
+/** Note that the shell has finished executing a line. */
+void alloc_line_done(void) {
+  lines++;
+  last_line_allocs = total_allocs - line_start_allocs;
+  last_line_bytes = total_bytes - line_start_bytes;
+  line_start_allocs = total_allocs;
+  line_start_bytes = total_bytes;
+}
+
+// Order sites by the number of bytes they allocated, largest first
+static int compare_sites(const void *a, const void *b) {
+  const struct alloc_site *x = *(const struct alloc_site **)a;
+  const struct alloc_site *y = *(const struct alloc_site **)b;
+  return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+/** Print the statistics gathered so far. */
+void alloc_report(FILE *out) {
+  fprintf(out, "Live:      %lu allocations, %zu bytes (peak %zu bytes)\n",
+          live, live_bytes, peak_bytes);
+  fprintf(out, "Total:     %lu allocations, %zu bytes over %lu lines\n",
+          total_allocs, total_bytes, lines);
+  if (lines > 0) {
+    fprintf(out, "Per line:  %.1f allocations, %.1f bytes\n",
+            (double)total_allocs / lines, (double)total_bytes / lines);
+    fprintf(out, "Last line: %lu allocations, %zu bytes\n",
+            last_line_allocs, last_line_bytes);
+  }
+
+  struct alloc_site *sorted[ALLOC_MAX_SITES + 1];
+  unsigned int n = 0;
+  for (unsigned int i = 0; i <= ALLOC_MAX_SITES; i++) {
+    if (sites[i].allocs > 0 || sites[i].live > 0) {
+      sorted[n++] = &sites[i];
+    }
+  }
+  qsort(sorted, n, sizeof(sorted[0]), compare_sites);
+
+  fprintf(out, "\n%-24s %10s %12s %8s %12s\n", "Site", "Allocs", "Bytes", "Live", "Live bytes");
+  for (unsigned int i = 0; i < n; i++) {
+    fprintf(out, "%-24s %10lu %12zu %8lu %12zu\n",
+            sorted[i]->tag != NULL ? sorted[i]->tag : "(other)", sorted[i]->allocs,
+            sorted[i]->bytes, sorted[i]->live, sorted[i]->live_bytes);
+  }
+}
+
+/** Start counting again. */
+void alloc_reset(void) {
+  for (unsigned int i = 0; i <= ALLOC_MAX_SITES; i++) {
+    sites[i].allocs = 0;
+    sites[i].bytes = 0;
+  }
+  peak_bytes = live_bytes;
+  lines = 0;
+  total_allocs = 0;
+  total_bytes = 0;
+  line_start_allocs = last_line_allocs = 0;
+  line_start_bytes = last_line_bytes = 0;
+}
+
+#endif /* ifdef ALLOC_PROFILE */
@@ -0,0 +1,83 @@
+#ifndef _ALLOC_H
+#define _ALLOC_H
+
+/* Allocation profiler.
+ *
+ * Built with ALLOC_PROFILE defined (make ALLOC_PROFILE=1), this header turns
+ * malloc, calloc, realloc, strdup, strndup and free in every file that
+ * includes it into calls that also record the allocation's size and call
+ * site (file and line). Built without it, the header defines nothing but
+ * no-op stand-ins, so the profiler costs nothing.
+ *
+ * Include it after all system headers: any header declaring one of the
+ * wrapped functions must already have been seen. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ALLOC_PROFILE
+
+#define ALLOC_STR_(x) #x
+#define ALLOC_STR(x) ALLOC_STR_(x)
+
+/* The call site an allocation is tagged with. */
+#define ALLOC_SITE (__FILE__ ":" ALLOC_STR(__LINE__))
+
+/** malloc, recording the allocation against the given site. */
+void *alloc_malloc(size_t size, const char *site);
+
+/** calloc, recording the allocation against the given site. */
+void *alloc_calloc(size_t n, size_t size, const char *site);
+
+/** realloc, recording the new allocation against the given site. Pointers
+ *  that weren't allocated through the profiler are resized all the same. */
+void *alloc_realloc(void *ptr, size_t size, const char *site);
+
+/** strdup, recording the copy against the given site. */
+char *alloc_strdup(const char *str, const char *site);
+
+/** strndup, recording the copy against the given site. */
+char *alloc_strndup(const char *str, size_t n, const char *site);
+
+/** free. Pointers that weren't allocated through the profiler (e.g. by
+ *  getline or by a module that isn't profiled) are freed all the same. */
+void alloc_free(void *ptr);
+
+/** Note that the shell has finished executing a line, so that allocations
+ *  can be reported per line. */
+void alloc_line_done(void);
+
+/** Print the statistics gathered so far. */
+void alloc_report(FILE *out);
+
+/** Start counting again (allocations that are still live stay tracked). */
+void alloc_reset(void);
+
+#ifndef ALLOC_NO_WRAP
+#define malloc(size) alloc_malloc((size), ALLOC_SITE)
+#define calloc(n, size) alloc_calloc((n), (size), ALLOC_SITE)
+#define realloc(ptr, size) alloc_realloc((ptr), (size), ALLOC_SITE)
+#define strdup(str) alloc_strdup((str), ALLOC_SITE)
+#define strndup(str, n) alloc_strndup((str), (n), ALLOC_SITE)
+#define free(ptr) alloc_free(ptr)
+#endif
+
+#else
+
+#define alloc_line_done() ((void)0)
+
+#endif /* ifdef ALLOC_PROFILE */
+
+
+/* Allocation profiler configuration. */
+
+/* Initial number of slots in the table of live allocations (a power of
+ * two); it doubles whenever it gets half full. */
+#define ALLOC_INITIAL_SLOTS 1024
+
+/* Maximum number of distinct call sites tracked; allocations from any
+ * further sites are lumped together. */
+#define ALLOC_MAX_SITES 256
+
+#endif /* ifndef _ALLOC_H */
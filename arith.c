@@ -0,0 +1,303 @@
+/**
+ * Integer arithmetic evaluation for $(( ... )) expansion.
+ *
+ * The expression is lexed on the fly and evaluated in a single pass by a
+ * precedence climbing parser, so nothing is allocated. Operands of && and ||
+ * and the branch of ?: that isn't taken are still parsed, but not evaluated
+ * (so "x != 0 && 10 / x" doesn't divide by zero).
+ */
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arith.h"
+
+// ============================== LEXING ===============================
+
+/** Binary (and ternary) operators, longest first so that lexing is greedy. */
+enum op { OP_NONE, OP_POW, OP_SHL, OP_SHR, OP_LE, OP_GE, OP_EQ, OP_NE, OP_AND,
+          OP_OR, OP_MUL, OP_DIV, OP_MOD, OP_ADD, OP_SUB, OP_LT, OP_GT,
+          OP_BITAND, OP_BITXOR, OP_BITOR, OP_COND };
+
+static const struct {
+  const char *text;
+  int prec;                /* Binding power; higher binds tighter. */
+  int right;               /* Is the operator right associative? */
+} OPS[] = {
+  [OP_NONE] = { "", 0, 0 },
+  [OP_POW] = { "**", 12, 1 },
+  [OP_SHL] = { "<<", 9, 0 },
+  [OP_SHR] = { ">>", 9, 0 },
+  [OP_LE] = { "<=", 8, 0 },
+  [OP_GE] = { ">=", 8, 0 },
+  [OP_EQ] = { "==", 7, 0 },
+  [OP_NE] = { "!=", 7, 0 },
+  [OP_AND] = { "&&", 3, 0 },
+  [OP_OR] = { "||", 2, 0 },
+  [OP_MUL] = { "*", 11, 0 },
+  [OP_DIV] = { "/", 11, 0 },
+  [OP_MOD] = { "%", 11, 0 },
+  [OP_ADD] = { "+", 10, 0 },
+  [OP_SUB] = { "-", 10, 0 },
+  [OP_LT] = { "<", 8, 0 },
+  [OP_GT] = { ">", 8, 0 },
+  [OP_BITAND] = { "&", 6, 0 },
+  [OP_BITXOR] = { "^", 5, 0 },
+  [OP_BITOR] = { "|", 4, 0 },
+  [OP_COND] = { "?", 1, 1 },
+};
+
+#define NUM_OPS (sizeof(OPS) / sizeof(OPS[0]))
+
+/** State of an evaluation. */
+struct parser {
+  const char *input;
+  unsigned int len;
+  unsigned int pos;
+  env_t *env;
+  const char *error;       /* First error encountered (NULL if none). */
+};
+
+/**
+ * Is the given character a digit?
+ */
+static int is_digit(char ch) {
+  // this relies on the fact that digits are ordered in the ASCII table
+  return ch >= '0' && ch <= '9';
+}
+
+// Is the given character allowed in a variable name?
+static int is_name_char(char ch, int first) {
+  return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_'
+         || (!first && is_digit(ch));
+}
+
+// Record an error (only the first one is kept)
+static void fail(struct parser *p, const char *message) {
+  if (p->error == NULL) {
+    p->error = message;
+  }
+}
+
+// Skip whitespace and return the current character ('\0' at the end)
+static char peek(struct parser *p) {
+  while (p->pos < p->len && (p->input[p->pos] == ' ' || p->input[p->pos] == '\t'
+                             || p->input[p->pos] == '\n')) {
+    p->pos++;
+  }
+  return p->pos < p->len ? p->input[p->pos] : '\0';
+}
+
+// Consume the given character if it comes next
+static int accept(struct parser *p, char ch) {
+  if (peek(p) == ch) {
+    p->pos++;
+    return 1;
+  }
+  return 0;
+}
+
+// Find the binary operator that comes next (without consuming it)
+static enum op peek_op(struct parser *p) {
+  peek(p);
+  const char *s = &p->input[p->pos];
+  unsigned int left = p->len - p->pos;
+  for (unsigned int op = 1; op < NUM_OPS; op++) {
+    unsigned int n = strlen(OPS[op].text);
+    if (n <= left && memcmp(s, OPS[op].text, n) == 0) {
+      return (enum op) op;
+    }
+  }
+  return OP_NONE;
+}
+
+// Convert a string to a number (with the same rules as literals)
+static long long to_number(struct parser *p, const char *str, unsigned int len) {
+  char buf[len + 1];
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+
+  char *end;
+  long long value = strtoll(buf, &end, 0);
+  while (*end == ' ' || *end == '\t' || *end == '\n') {
+    end++;
+  }
+  if (end == buf || *end != '\0') {
+    fail(p, "not a number");
+  }
+  return value;
+}
+
+// ============================= EVALUATION ============================
+
+static long long parse_expr(struct parser *p, int min_prec, int noeval);
+
+// Evaluate a literal, variable, parenthesized expression or unary operation
+static long long parse_operand(struct parser *p, int noeval) {
+  char ch = peek(p);
+
+  if (accept(p, '(')) {
+    long long value = parse_expr(p, 1, noeval);
+    if (!accept(p, ')')) {
+      fail(p, "missing ')'");
+    }
+    return value;
+  }
+
+  // unary operators bind tighter than any binary one (so -2**2 is 4)
+  if (ch == '-' || ch == '+' || ch == '!' || ch == '~') {
+    p->pos++;
+    long long value = parse_operand(p, noeval);
+    switch (ch) {
+      case '-':
+        return (long long) (0ULL - (unsigned long long) value);
+      case '!':
+        return !value;
+      case '~':
+        return ~value;
+      default:
+        return value;
+    }
+  }
+
+  if (is_digit(ch)) {
+    unsigned int start = p->pos;
+    // hex digits and the x of 0x; to_number rejects anything malformed
+    while (p->pos < p->len && (is_name_char(p->input[p->pos], 0))) {
+      p->pos++;
+    }
+    return to_number(p, &p->input[start], p->pos - start);
+  }
+
+  // a variable, optionally written as $NAME
+  if (ch == '$' && p->pos + 1 < p->len && is_name_char(p->input[p->pos + 1], 1)) {
+    p->pos++;
+    ch = p->input[p->pos];
+  }
+  if (is_name_char(ch, 1)) {
+    unsigned int start = p->pos;
+    while (p->pos < p->len && is_name_char(p->input[p->pos], 0)) {
+      p->pos++;
+    }
+    if (noeval || p->env == NULL) {
+      return 0;
+    }
+
+    unsigned int n = p->pos - start;
+    char name[n + 1];
+    memcpy(name, &p->input[start], n);
+    name[n] = '\0';
+    const char *value = env_get(p->env, name);
+    if (value == NULL || value[0] == '\0') {
+      return 0;
+    }
+    return to_number(p, value, strlen(value));
+  }
+
+  fail(p, ch == '\0' ? "operand expected" : "syntax error");
+  return 0;
+}
+
+// Apply a binary operator
+static long long apply(struct parser *p, enum op op, long long a, long long b) {
+  // do the wrapping arithmetic unsigned, where overflow is well defined
+  unsigned long long ua = a;
+  unsigned long long ub = b;
+  switch (op) {
+    case OP_ADD: return (long long) (ua + ub);
+    case OP_SUB: return (long long) (ua - ub);
+    case OP_MUL: return (long long) (ua * ub);
+    case OP_DIV:
+    case OP_MOD:
+      if (b == 0) {
+        fail(p, "division by zero");
+        return 0;
+      }
+      if (a == LLONG_MIN && b == -1) {
+        return op == OP_DIV ? LLONG_MIN : 0;
+      }
+      return op == OP_DIV ? a / b : a % b;
+    case OP_POW: {
+      if (b < 0) {
+        fail(p, "exponent less than 0");
+        return 0;
+      }
+      unsigned long long result = 1;
+      // exponentiation by squaring
+      while (b > 0) {
+        if (b & 1) {
+          result *= ua;
+        }
+        ua *= ua;
+        b >>= 1;
+      }
+      return (long long) result;
+    }
+    case OP_SHL: return (long long) (ua << (ub & 63));
+    case OP_SHR: return a >> (ub & 63);
+    case OP_LT: return a < b;
+    case OP_LE: return a <= b;
+    case OP_GT: return a > b;
+    case OP_GE: return a >= b;
+    case OP_EQ: return a == b;
+    case OP_NE: return a != b;
+    case OP_BITAND: return a & b;
+    case OP_BITXOR: return a ^ b;
+    case OP_BITOR: return a | b;
+    default: return 0;
+  }
+}
+
+// Evaluate an expression made of operators that bind at least as tightly as
+// min_prec. With noeval set, the expression is only parsed.
+static long long parse_expr(struct parser *p, int min_prec, int noeval) {
+  long long left = parse_operand(p, noeval);
+
+  while (p->error == NULL) {
+    enum op op = peek_op(p);
+    if (op == OP_NONE || OPS[op].prec < min_prec) {
+      break;
+    }
+    p->pos += strlen(OPS[op].text);
+    int next_prec = OPS[op].right ? OPS[op].prec : OPS[op].prec + 1;
+
+    if (op == OP_AND || op == OP_OR) {
+      // short circuit: the right side only counts if the left doesn't decide
+      int decided = op == OP_AND ? !left : left != 0;
+      long long right = parse_expr(p, next_prec, noeval || decided);
+      left = decided ? op == OP_OR : right != 0;
+    }
+    else if (op == OP_COND) {
+      long long then_value = parse_expr(p, 1, noeval || !left);
+      if (!accept(p, ':')) {
+        fail(p, "missing ':'");
+        break;
+      }
+      long long else_value = parse_expr(p, next_prec, noeval || left);
+      left = left ? then_value : else_value;
+    }
+    else {
+      long long right = parse_expr(p, next_prec, noeval);
+      left = noeval ? 0 : apply(p, op, left, right);
+    }
+  }
+
+  return left;
+}
+
+/** Evaluate an integer arithmetic expression. */
+int arith_eval(const char *expr, unsigned int len, env_t *env, long long *result, const char **error) {
+  struct parser p = { expr, len, 0, env, NULL };
+
+  long long value = parse_expr(&p, 1, 0);
+  if (p.error == NULL && peek(&p) != '\0') {
+    fail(&p, "syntax error");
+  }
+
+  if (p.error != NULL) {
+    *error = p.error;
+    return -1;
+  }
+  *result = value;
+  return 0;
+}
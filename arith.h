@@ -0,0 +1,15 @@
+#ifndef _ARITH_H
+#define _ARITH_H
+
+#include "env.h"
+
+/** Evaluate the integer arithmetic expression made up of the first len
+ *  characters of expr, as used by $(( ... )) expansion. Supports decimal,
+ *  octal (0...) and hex (0x...) literals, variables (NAME or $NAME, looked up
+ *  in env; unset or empty variables are 0), parentheses and the C operators
+ *  + - * / % ** << >> < <= > >= == != & ^ | && || ! ~ and ?:, with C
+ *  precedence. On success returns 0 and stores the value in *result. On
+ *  error returns -1 and points *error at a message. env may be NULL. */
+int arith_eval(const char *expr, unsigned int len, env_t *env, long long *result, const char **error);
+
+#endif /* ifndef _ARITH_H */
@@ -0,0 +1,427 @@
+/**
+ * Completion of command names and file paths.
+ *
+ * The executables of each PATH directory are kept in a prefix trie of their
+ * own, built the first time a command is completed and rebuilt only when
+ * that directory's mtime changes. Completing a command costs a stat per
+ * PATH directory plus a walk of each trie below the typed prefix, however
+ * many programs there are. File paths are completed by reading the one
+ * directory the word points into.
+ */
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "complete.h"
+
+// =============================== TRIES ===============================
+
+/** A node of a trie. Nodes refer to each other by index; 0 (the root) never
+ *  appears as a child or sibling, so it doubles as "none". */
+struct trie_node {
+  char c;                    /* The character leading to this node. */
+  unsigned char end;         /* Does a name end here? */
+  unsigned int child;        /* First child (children are sorted by c). */
+  unsigned int sibling;      /* Next sibling. */
+};
+
+/** A prefix trie of names. */
+struct trie {
+  struct trie_node *nodes;   /* All the nodes, the root first. */
+  unsigned int count;
+  unsigned int capacity;
+};
+
+// Empty a trie (creating its root if needed)
+static void trie_reset(struct trie *t) {
+  if (t->nodes == NULL) {
+    t->capacity = 256;
+    t->nodes = (struct trie_node *) malloc(t->capacity * sizeof(struct trie_node));
+    assert(t->nodes != NULL);
+  }
+  memset(&t->nodes[0], 0, sizeof(struct trie_node));
+  t->count = 1;
+}
+
+// Add a new node for c in front of sibling. Returns its index.
+static unsigned int trie_node_new(struct trie *t, char c, unsigned int sibling) {
+  if (t->count == t->capacity) {
+    t->capacity *= 2;
+    t->nodes = (struct trie_node *) realloc(t->nodes, t->capacity * sizeof(struct trie_node));
+    assert(t->nodes != NULL);
+  }
+  struct trie_node *n = &t->nodes[t->count];
+  n->c = c;
+  n->end = 0;
+  n->child = 0;
+  n->sibling = sibling;
+  return t->count++;
+}
+
+// Add a name to a trie
+static void trie_insert(struct trie *t, const char *name) {
+  unsigned int node = 0;
+  for (; *name != '\0'; name++) {
+    // find the child for this character, or the place to put it in order
+    unsigned int prev = 0;
+    unsigned int next = t->nodes[node].child;
+    while (next != 0 && (unsigned char) t->nodes[next].c < (unsigned char) *name) {
+      prev = next;
+      next = t->nodes[next].sibling;
+    }
+    if (next == 0 || t->nodes[next].c != *name) {
+      // (nodes may move, so link the new one by index afterwards)
+      unsigned int added = trie_node_new(t, *name, next);
+      if (prev == 0) {
+        t->nodes[node].child = added;
+      }
+      else {
+        t->nodes[prev].sibling = added;
+      }
+      next = added;
+    }
+    node = next;
+  }
+  t->nodes[node].end = 1;
+}
+
+/** A growable array of words. */
+struct wordlist {
+  char **data;
+  unsigned int size;
+  unsigned int capacity;
+};
+
+// Add a copy of the first len characters of word
+static void wordlist_add(struct wordlist *wl, const char *word, size_t len) {
+  if (wl->size == wl->capacity) {
+    wl->capacity = wl->capacity ? wl->capacity * 2 : 16;
+    wl->data = (char **) realloc(wl->data, wl->capacity * sizeof(char *));
+    assert(wl->data != NULL);
+  }
+  wl->data[wl->size] = strndup(word, len);
+  assert(wl->data[wl->size] != NULL);
+  wl->size++;
+}
+
+// Add every name below node to the list; buf holds the len characters
+// leading to node and has room for the longest name
+static void trie_collect_from(const struct trie *t, unsigned int node, char *buf,
+                              size_t len, struct wordlist *out) {
+  if (t->nodes[node].end) {
+    wordlist_add(out, buf, len);
+  }
+  for (unsigned int c = t->nodes[node].child; c != 0; c = t->nodes[c].sibling) {
+    buf[len] = t->nodes[c].c;
+    trie_collect_from(t, c, buf, len + 1, out);
+  }
+}
+
+// Add every name in the trie that starts with prefix to the list
+static void trie_collect(const struct trie *t, const char *prefix, struct wordlist *out) {
+  if (t->nodes == NULL) {
+    return;
+  }
+  // walk down to the node the prefix leads to
+  unsigned int node = 0;
+  for (const char *p = prefix; *p != '\0'; p++) {
+    unsigned int c = t->nodes[node].child;
+    while (c != 0 && t->nodes[c].c != *p) {
+      c = t->nodes[c].sibling;
+    }
+    if (c == 0) {
+      return;
+    }
+    node = c;
+  }
+
+  // no name is longer than NAME_MAX
+  char buf[NAME_MAX + 1];
+  size_t len = strlen(prefix);
+  memcpy(buf, prefix, len);
+  trie_collect_from(t, node, buf, len, out);
+}
+
+// ========================== PATH DIRECTORIES =========================
+
+/** The executables of a PATH directory. */
+struct path_dir {
+  char *path;                /* The directory as it appears in PATH. */
+  struct timespec mtime;     /* Its mtime when it was read. */
+  int racy;                  /* Was it modified too recently to trust mtime? */
+  struct trie names;         /* The executables in it. */
+  unsigned long last_used;   /* For evicting the least recently used one. */
+};
+
+static struct path_dir cache[COMPLETE_CACHE_DIRS];
+static unsigned long cache_clock;
+
+/** Drop every cached PATH directory. */
+void complete_cache_clear(void) {
+  for (int i = 0; i < COMPLETE_CACHE_DIRS; i++) {
+    free(cache[i].path);
+    free(cache[i].names.nodes);
+    memset(&cache[i], 0, sizeof(cache[i]));
+  }
+}
+
+// Read the executables in the directory open on fd into the trie
+static void path_dir_read(struct trie *t, int fd) {
+  trie_reset(t);
+  DIR *dir = fdopendir(fd);
+  if (dir == NULL) {
+    close(fd);
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) {
+      continue;
+    }
+    struct stat st;
+    if (fstatat(fd, entry->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode)
+        || (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) == 0) {
+      continue;
+    }
+    trie_insert(t, entry->d_name);
+  }
+  closedir(dir);
+}
+
+// Get the trie of executables in the given directory, reading the
+// directory only if it isn't cached or has changed since it was cached.
+// Returns NULL if it can't be read.
+static struct trie *path_dir_get(const char *path, size_t len) {
+  char dir[PATH_MAX];
+  if (len >= sizeof(dir)) {
+    return NULL;
+  }
+  memcpy(dir, path, len);
+  dir[len] = '\0';
+
+  struct stat st;
+  if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+    return NULL;
+  }
+
+  cache_clock++;
+  struct path_dir *victim = &cache[0];
+  for (int i = 0; i < COMPLETE_CACHE_DIRS; i++) {
+    struct path_dir *d = &cache[i];
+    if (d->path != NULL && strcmp(d->path, dir) == 0) {
+      d->last_used = cache_clock;
+      if (!d->racy && d->mtime.tv_sec == st.st_mtim.tv_sec
+          && d->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return &d->names;
+      }
+      // stale, so reread it in place
+      victim = d;
+      break;
+    }
+    if (d->path == NULL || (victim->path != NULL && d->last_used < victim->last_used)) {
+      victim = d;
+    }
+  }
+
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  if (victim->path == NULL || strcmp(victim->path, dir) != 0) {
+    free(victim->path);
+    victim->path = strdup(dir);
+    assert(victim->path != NULL);
+  }
+  path_dir_read(&victim->names, fd);
+  victim->mtime = st.st_mtim;
+  // A change made within the same timestamp tick as our read wouldn't move
+  // the mtime, so a directory modified this recently is read again next time.
+  victim->racy = st.st_mtim.tv_sec >= now.tv_sec - 1;
+  victim->last_used = cache_clock;
+  return &victim->names;
+}
+
+// ============================ COMPLETION =============================
+
+// Add the builtins and executables in PATH that start with prefix
+static void complete_command(const char *prefix, const char *path, const char **builtins,
+                             struct wordlist *out) {
+  size_t len = strlen(prefix);
+  for (unsigned int i = 0; builtins != NULL && builtins[i] != NULL; i++) {
+    if (strncmp(builtins[i], prefix, len) == 0) {
+      wordlist_add(out, builtins[i], strlen(builtins[i]));
+    }
+  }
+
+  while (path != NULL) {
+    const char *colon = strchr(path, ':');
+    size_t dirLen = colon != NULL ? (size_t) (colon - path) : strlen(path);
+    // an empty entry stands for the current directory
+    struct trie *t = dirLen > 0 ? path_dir_get(path, dirLen) : path_dir_get(".", 1);
+    if (t != NULL) {
+      trie_collect(t, prefix, out);
+    }
+    path = colon != NULL ? colon + 1 : NULL;
+  }
+}
+
+// Add the paths that start with word
+static void complete_path(const char *word, struct wordlist *out) {
+  const char *slash = strrchr(word, '/');
+  const char *base = slash != NULL ? slash + 1 : word;
+  size_t dirLen = base - word;
+  size_t baseLen = strlen(base);
+
+  char dirPath[PATH_MAX];
+  if (dirLen >= sizeof(dirPath)) {
+    return;
+  }
+  if (dirLen == 0) {
+    strcpy(dirPath, ".");
+  }
+  else {
+    memcpy(dirPath, word, dirLen);
+    dirPath[dirLen] = '\0';
+  }
+
+  DIR *dir = opendir(dirPath);
+  if (dir == NULL) {
+    return;
+  }
+
+  char full[PATH_MAX + NAME_MAX + 2];
+  memcpy(full, word, dirLen);
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    const char *name = entry->d_name;
+    // hidden files only come up once a dot has been typed
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+        || (name[0] == '.' && base[0] != '.') || strncmp(name, base, baseLen) != 0) {
+      continue;
+    }
+
+    int isDir = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+      struct stat st;
+      isDir = fstatat(dirfd(dir), name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+    }
+    size_t nameLen = strlen(name);
+    memcpy(full + dirLen, name, nameLen);
+    if (isDir) {
+      full[dirLen + nameLen++] = '/';
+    }
+    wordlist_add(out, full, dirLen + nameLen);
+  }
+  closedir(dir);
+}
+
+// Is position start of line where a command name goes (at the start of the
+// line, after a separator or after a keyword that a command follows)?
+static int is_command_position(const char *line, unsigned int start) {
+  static const char *KEYWORDS[] = { "if", "then", "elif", "else", "while", "do", NULL };
+
+  unsigned int end = start;
+  while (end > 0 && (line[end - 1] == ' ' || line[end - 1] == '\t')) {
+    end--;
+  }
+  if (end == 0 || strchr(";|&(", line[end - 1]) != NULL) {
+    return 1;
+  }
+
+  unsigned int wordStart = end;
+  while (wordStart > 0 && strchr(" \t;|&(", line[wordStart - 1]) == NULL) {
+    wordStart--;
+  }
+  for (unsigned int i = 0; KEYWORDS[i] != NULL; i++) {
+    if (strlen(KEYWORDS[i]) == end - wordStart
+        && strncmp(line + wordStart, KEYWORDS[i], end - wordStart) == 0) {
+      // ...as long as the keyword is itself where a command goes
+      return is_command_position(line, wordStart);
+    }
+  }
+  return 0;
+}
+
+static int compare_words(const void *a, const void *b) {
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/** Find the ways the word that ends at position cursor of line could be
+ *  completed. */
+unsigned int complete_word(const char *line, unsigned int cursor, const char *path,
+                           const char **builtins, unsigned int *start, char ***matches) {
+  // the word starts after the last separator that isn't inside quotes
+  unsigned int wordStart = 0;
+  char quote = '\0';
+  for (unsigned int i = 0; i < cursor; i++) {
+    if (quote != '\0') {
+      if (line[i] == quote) {
+        quote = '\0';
+      }
+    }
+    else if (line[i] == '"' || line[i] == '\'') {
+      quote = line[i];
+    }
+    else if (strchr(" \t;|&<>(", line[i]) != NULL) {
+      wordStart = i + 1;
+    }
+  }
+  *start = wordStart;
+
+  // a quote the word opens is kept in front of every match
+  unsigned int prefixStart = wordStart;
+  if (prefixStart < cursor && (line[prefixStart] == '"' || line[prefixStart] == '\'')) {
+    prefixStart++;
+  }
+  char *word = strndup(line + prefixStart, cursor - prefixStart);
+  assert(word != NULL);
+
+  struct wordlist found = { NULL, 0, 0 };
+  if (prefixStart == wordStart && strchr(word, '/') == NULL
+      && is_command_position(line, wordStart)) {
+    complete_command(word, path, builtins, &found);
+  }
+  else {
+    complete_path(word, &found);
+  }
+  free(word);
+
+  // the same program can be in several directories
+  qsort(found.data, found.size, sizeof(char *), compare_words);
+  unsigned int size = 0;
+  for (unsigned int i = 0; i < found.size; i++) {
+    if (size > 0 && strcmp(found.data[size - 1], found.data[i]) == 0) {
+      free(found.data[i]);
+      continue;
+    }
+    if (prefixStart != wordStart) {
+      size_t len = strlen(found.data[i]);
+      char *quoted = (char *) malloc(len + 2);
+      assert(quoted != NULL);
+      quoted[0] = line[wordStart];
+      memcpy(quoted + 1, found.data[i], len + 1);
+      free(found.data[i]);
+      found.data[i] = quoted;
+    }
+    found.data[size++] = found.data[i];
+  }
+
+  if (size == 0) {
+    free(found.data);
+    found.data = NULL;
+  }
+  *matches = found.data;
+  return size;
+}
@@ -0,0 +1,27 @@
+#ifndef _COMPLETE_H
+#define _COMPLETE_H
+
+/** Find the ways the word that ends at position cursor of line could be
+ *  completed. Sets *start to the position the word starts at and *matches
+ *  to a sorted array of the words it could be replaced with. A word in
+ *  command position that has no '/' in it is completed from the given NULL
+ *  terminated list of builtins and the executables in the directories of
+ *  path (a colon separated list such as $PATH, which may be NULL); any other
+ *  word is completed as a file path, directories getting a trailing '/'.
+ *  Returns the number of matches. The caller owns the array and every word
+ *  in it, and is responsible for freeing them. Returns 0 (and sets *matches
+ *  to NULL) if there are none. */
+unsigned int complete_word(const char *line, unsigned int cursor, const char *path,
+                           const char **builtins, unsigned int *start, char ***matches);
+
+/** Drop every cached PATH directory. */
+void complete_cache_clear(void);
+
+
+/* Completion configuration. */
+
+/* Maximum number of PATH directories whose executables are kept between
+ * completions. Each one is only read again once its mtime changes. */
+#define COMPLETE_CACHE_DIRS 64
+
+#endif /* ifndef _COMPLETE_H */
@@ -0,0 +1,291 @@
+/**
+ * Shell variable store.
+ *
+ * Variables live in an open-addressing hash table with linear probing. Each
+ * entry keeps its variable as a single "NAME=value" string, so the envp array
+ * handed to execve is just a list of pointers into the table. That array is
+ * cached and only rebuilt when an exported variable changes, which we track
+ * with a generation counter.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "env.h"
+
+/* Marks a slot whose variable was removed; probing continues past it. */
+static char TOMBSTONE[] = "";
+
+/** A single slot of the hash table. */
+struct env_entry {
+  char *pair;              /* "NAME=value", NULL if empty, TOMBSTONE if removed. */
+  unsigned int name_len;   /* Length of NAME within pair. */
+  unsigned int hash;       /* Hash of NAME. */
+  int exported;            /* Is the variable passed on to child processes? */
+};
+
+/** Main data structure for the variable store. */
+struct env {
+  struct env_entry *slots; /* The hash table (capacity is a power of two). */
+  unsigned int capacity;   /* Number of slots in the table. */
+  unsigned int size;       /* Number of live variables. */
+  unsigned int used;       /* Number of live variables plus tombstones. */
+  unsigned int exported;   /* Number of live exported variables. */
+  unsigned long generation;      /* Bumped whenever an exported variable changes. */
+  char **envp;                   /* Cached envp array (NULL until first built). */
+  unsigned long envp_generation; /* Generation the cached envp was built at. */
+};
+
+// FNV-1a hash of the first n characters of name
+static unsigned int hash_name(const char *name, unsigned int n) {
+  unsigned int h = 2166136261u;
+  for (unsigned int i = 0; i < n; i++) {
+    h ^= (unsigned char) name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Find the slot holding the variable with the given name. Returns its index,
+// or -1 if it isn't there; in that case *insert_at is set to the slot a new
+// variable with this name should go in.
+static int find_slot(env_t *env, const char *name, unsigned int n,
+                     unsigned int hash, unsigned int *insert_at) {
+  unsigned int mask = env->capacity - 1;
+  unsigned int idx = hash & mask;
+  int tombstone = -1;
+
+  while (env->slots[idx].pair != NULL) {
+    struct env_entry *e = &env->slots[idx];
+    if (e->pair == TOMBSTONE) {
+      if (tombstone == -1) {
+        tombstone = idx;
+      }
+    }
+    else if (e->hash == hash && e->name_len == n && memcmp(e->pair, name, n) == 0) {
+      return idx;
+    }
+    idx = (idx + 1) & mask;
+  }
+
+  if (insert_at != NULL) {
+    *insert_at = tombstone != -1 ? (unsigned int) tombstone : idx;
+  }
+  return -1;
+}
+
+// Rehash every live variable into a table of the given capacity, dropping
+// tombstones along the way
+static void rehash(env_t *env, unsigned int capacity) {
+  struct env_entry *old = env->slots;
+  unsigned int old_capacity = env->capacity;
+
+  env->slots = (struct env_entry *) calloc(capacity, sizeof(struct env_entry));
+  assert(env->slots != NULL);
+  env->capacity = capacity;
+  env->used = env->size;
+
+  for (unsigned int i = 0; i < old_capacity; i++) {
+    if (old[i].pair != NULL && old[i].pair != TOMBSTONE) {
+      unsigned int idx = old[i].hash & (capacity - 1);
+      while (env->slots[idx].pair != NULL) {
+        idx = (idx + 1) & (capacity - 1);
+      }
+      env->slots[idx] = old[i];
+    }
+  }
+  free(old);
+}
+
+// Set the first n characters of name to value, creating the variable with the
+// given exported flag if it doesn't exist yet
+static void put(env_t *env, const char *name, unsigned int n, const char *value, int exported) {
+  // Make room first so the insertion slot we find stays valid
+  if ((env->used + 1) * 100 > env->capacity * ENV_MAX_LOAD) {
+    unsigned int capacity = env->capacity;
+    if ((env->size + 1) * 100 > capacity * ENV_MAX_LOAD / 2) {
+      capacity *= ENV_GROWTH_FACTOR;
+    }
+    rehash(env, capacity);
+  }
+
+  unsigned int hash = hash_name(name, n);
+  unsigned int insert_at;
+  int idx = find_slot(env, name, n, hash, &insert_at);
+
+  unsigned int value_len = strlen(value);
+  char *pair = (char *) malloc(n + value_len + 2);
+  assert(pair != NULL);
+  memcpy(pair, name, n);
+  pair[n] = '=';
+  memcpy(pair + n + 1, value, value_len + 1);
+
+  struct env_entry *e;
+  if (idx != -1) {
+    e = &env->slots[idx];
+    free(e->pair);
+  }
+  else {
+    e = &env->slots[insert_at];
+    if (e->pair == NULL) {
+      env->used++;
+    }
+    env->size++;
+    e->name_len = n;
+    e->hash = hash;
+    e->exported = exported;
+    if (exported) {
+      env->exported++;
+    }
+  }
+  e->pair = pair;
+
+  if (e->exported) {
+    env->generation++;
+  }
+}
+
+/** Construct a new variable store. */
+env_t *env_new(char **envp) {
+  env_t *env = (env_t *) malloc(sizeof(env_t));
+  if (env == NULL) {
+    return NULL;
+  }
+
+  env->slots = (struct env_entry *) calloc(ENV_INITIAL_CAPACITY, sizeof(struct env_entry));
+  if (env->slots == NULL) {
+    free(env);
+    return NULL;
+  }
+  env->capacity = ENV_INITIAL_CAPACITY;
+  env->size = 0;
+  env->used = 0;
+  env->exported = 0;
+  env->generation = 1;
+  env->envp = NULL;
+  env->envp_generation = 0;
+
+  for (unsigned int i = 0; envp != NULL && envp[i] != NULL; i++) {
+    const char *eq = strchr(envp[i], '=');
+    if (eq != NULL && eq != envp[i]) {
+      put(env, envp[i], eq - envp[i], eq + 1, 1);
+    }
+  }
+
+  return env;
+}
+
+/** Delete the variable store, freeing all memory it occupies. */
+void env_delete(env_t *env) {
+  if (env == NULL) {
+    return;
+  }
+  for (unsigned int i = 0; i < env->capacity; i++) {
+    if (env->slots[i].pair != TOMBSTONE) {
+      free(env->slots[i].pair);
+    }
+  }
+  free(env->slots);
+  free(env->envp);
+  free(env);
+}
+
+/** Get the value of the variable with the given name. */
+const char *env_get(env_t *env, const char *name) {
+  assert(env != NULL);
+  unsigned int n = strlen(name);
+  int idx = find_slot(env, name, n, hash_name(name, n), NULL);
+  if (idx == -1) {
+    return NULL;
+  }
+  // The value starts right after the '='
+  return env->slots[idx].pair + n + 1;
+}
+
+/** Set the variable with the given name. */
+void env_set(env_t *env, const char *name, const char *value) {
+  assert(env != NULL);
+  put(env, name, strlen(name), value, 0);
+}
+
+/** Mark the variable with the given name as exported. */
+int env_export(env_t *env, const char *name) {
+  assert(env != NULL);
+  unsigned int n = strlen(name);
+  int idx = find_slot(env, name, n, hash_name(name, n), NULL);
+  if (idx == -1) {
+    return -1;
+  }
+  if (!env->slots[idx].exported) {
+    env->slots[idx].exported = 1;
+    env->exported++;
+    env->generation++;
+  }
+  return 0;
+}
+
+/** Remove the variable with the given name. */
+int env_unset(env_t *env, const char *name) {
+  assert(env != NULL);
+  unsigned int n = strlen(name);
+  int idx = find_slot(env, name, n, hash_name(name, n), NULL);
+  if (idx == -1) {
+    return -1;
+  }
+
+  struct env_entry *e = &env->slots[idx];
+  if (e->exported) {
+    env->exported--;
+    env->generation++;
+  }
+  free(e->pair);
+  // Leave a tombstone so probe sequences running through this slot still work
+  e->pair = TOMBSTONE;
+  env->size--;
+  return 0;
+}
+
+/** The length of the variable name at the start of the given string. */
+unsigned int env_name_len(const char *str) {
+  unsigned int i = 0;
+  while ((str[i] >= 'a' && str[i] <= 'z') || (str[i] >= 'A' && str[i] <= 'Z')
+         || str[i] == '_' || (i > 0 && str[i] >= '0' && str[i] <= '9')) {
+    i++;
+  }
+  return i;
+}
+
+/** Is the given string a valid variable name? */
+int env_valid_name(const char *name) {
+  unsigned int n = env_name_len(name);
+  return n > 0 && name[n] == '\0';
+}
+
+/** Get a NULL-terminated "NAME=value" array of the exported variables. */
+char **env_envp(env_t *env) {
+  assert(env != NULL);
+  if (env->envp != NULL && env->envp_generation == env->generation) {
+    return env->envp;
+  }
+
+  env->envp = (char **) realloc(env->envp, (env->exported + 1) * sizeof(char *));
+  assert(env->envp != NULL);
+
+  unsigned int n = 0;
+  for (unsigned int i = 0; i < env->capacity; i++) {
+    struct env_entry *e = &env->slots[i];
+    if (e->pair != NULL && e->pair != TOMBSTONE && e->exported) {
+      env->envp[n++] = e->pair;
+    }
+  }
+  env->envp[n] = NULL;
+  env->envp_generation = env->generation;
+
+  return env->envp;
+}
+
+/** The number of variables currently in the store. */
+unsigned int env_size(env_t *env) {
+  assert(env != NULL);
+  return env->size;
+}
@@ -0,0 +1,54 @@
+#ifndef _ENV_H
+#define _ENV_H
+
+/** Type of a shell variable store (fields are hidden). */
+typedef struct env env_t;
+
+/** Construct a new variable store. Every "NAME=value" entry of the given
+ *  NULL-terminated environment block (which may be NULL) is added as an
+ *  exported variable. */
+env_t *env_new(char **envp);
+
+/** Delete the variable store, freeing all memory it occupies. */
+void env_delete(env_t *env);
+
+/** Get the value of the variable with the given name, or NULL if it is unset. */
+const char *env_get(env_t *env, const char *name);
+
+/** Set the variable with the given name to a copy of value, creating it if
+ *  necessary. An existing variable keeps its exported flag. */
+void env_set(env_t *env, const char *name, const char *value);
+
+/** Mark the variable with the given name as exported. Returns 0 on success,
+ *  or -1 if the variable is unset. */
+int env_export(env_t *env, const char *name);
+
+/** Remove the variable with the given name. Returns 0 on success, or -1 if
+ *  the variable was not set. */
+int env_unset(env_t *env, const char *name);
+
+/** Is the given string a valid variable name? */
+int env_valid_name(const char *name);
+
+/** The length of the variable name at the start of the given string. */
+unsigned int env_name_len(const char *str);
+
+/** Get a NULL-terminated "NAME=value" array of the exported variables,
+ *  suitable for passing to execve. The array is owned by the store and is
+ *  only rebuilt after an exported variable has changed, so it stays valid
+ *  until the next env_set/env_export/env_unset call. */
+char **env_envp(env_t *env);
+
+/** The number of variables currently in the store. */
+unsigned int env_size(env_t *env);
+
+
+/* Variable store configuration. */
+#define ENV_INITIAL_CAPACITY 64
+#define ENV_GROWTH_FACTOR 2
+
+/* Grow once live entries plus tombstones exceed this fraction (in percent)
+ * of the table, to keep linear probe sequences short. */
+#define ENV_MAX_LOAD 70
+
+#endif /* ifndef _ENV_H */
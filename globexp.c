@@ -0,0 +1,528 @@
+/**
+ * Pathname (glob) expansion.
+ *
+ * Directories are read with large getdents64 batches into a compact listing
+ * (all names back to back in one buffer, sorted once). Listings are cached
+ * across commands, keyed by the directory's device and inode, and reused for
+ * as long as the directory's mtime is unchanged. Each path component of a
+ * pattern is compiled once into a small array of matching operations that is
+ * run without recursion against every name in the listing.
+ */
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "globexp.h"
+
+// ============================= PATTERNS ==============================
+
+enum pat_type { PAT_CHAR, PAT_ANY, PAT_STAR, PAT_CLASS };
+
+/** A single matching operation of a compiled pattern. */
+struct pat_op {
+  unsigned char type;      /* One of enum pat_type. */
+  unsigned char c;         /* The character to match (PAT_CHAR). */
+  unsigned char set[32];   /* Bitmap of matching characters (PAT_CLASS). */
+};
+
+/** A compiled path component pattern. */
+struct pattern {
+  struct pat_op *ops;
+  unsigned int count;
+  unsigned int min_len;    /* Shortest name that could possibly match. */
+  int dot_ok;              /* May a name starting with '.' match? */
+};
+
+// Compile the first len characters of src into a pattern
+static void pattern_compile(struct pattern *p, const char *src, unsigned int len) {
+  p->ops = (struct pat_op *) malloc((len + 1) * sizeof(struct pat_op));
+  assert(p->ops != NULL);
+  p->count = 0;
+  p->min_len = 0;
+  // hidden files are only matched by a pattern that starts with a literal dot
+  p->dot_ok = len > 0 && src[0] == '.';
+
+  unsigned int i = 0;
+  while (i < len) {
+    struct pat_op *op = &p->ops[p->count];
+    char c = src[i];
+
+    if (c == '*') {
+      // consecutive stars behave like a single one
+      if (p->count == 0 || p->ops[p->count - 1].type != PAT_STAR) {
+        op->type = PAT_STAR;
+        p->count++;
+      }
+      i++;
+      continue;
+    }
+
+    if (c == '?') {
+      op->type = PAT_ANY;
+      i++;
+    }
+    else if (c == '[') {
+      // find the closing bracket; a ']' right after '[' or '[!' is literal
+      unsigned int j = i + 1;
+      if (j < len && (src[j] == '!' || src[j] == '^')) {
+        j++;
+      }
+      if (j < len && src[j] == ']') {
+        j++;
+      }
+      while (j < len && src[j] != ']') {
+        j++;
+      }
+
+      if (j >= len) {
+        // no closing bracket, so the '[' is just a character
+        op->type = PAT_CHAR;
+        op->c = '[';
+        i++;
+      }
+      else {
+        unsigned int k = i + 1;
+        int negate = src[k] == '!' || src[k] == '^';
+        if (negate) {
+          k++;
+        }
+
+        op->type = PAT_CLASS;
+        memset(op->set, 0, sizeof(op->set));
+        while (k < j) {
+          unsigned char lo = src[k];
+          unsigned char hi = lo;
+          if (k + 2 < j && src[k + 1] == '-') {
+            hi = src[k + 2];
+            k += 2;
+          }
+          for (unsigned int ch = lo; ch <= hi; ch++) {
+            op->set[ch >> 3] |= 1 << (ch & 7);
+          }
+          k++;
+        }
+        if (negate) {
+          for (int b = 0; b < 32; b++) {
+            op->set[b] = ~op->set[b];
+          }
+        }
+        // '/' and the terminator can never be part of a name
+        op->set[0] &= ~1;
+        op->set['/' >> 3] &= ~(1 << ('/' & 7));
+        i = j + 1;
+      }
+    }
+    else {
+      op->type = PAT_CHAR;
+      op->c = c;
+      i++;
+    }
+
+    p->count++;
+    p->min_len++;
+  }
+}
+
+// Does the given name match the compiled pattern? A '*' can always be
+// retried from one character further along, and a later '*' makes earlier
+// choices irrelevant, so remembering the most recent star is enough.
+static int pattern_match(const struct pattern *p, const char *name, unsigned int name_len) {
+  if (name_len < p->min_len || (name[0] == '.' && !p->dot_ok)) {
+    return 0;
+  }
+
+  unsigned int pi = 0;
+  unsigned int si = 0;
+  unsigned int star_pi = 0;
+  unsigned int star_si = 0;
+  int have_star = 0;
+
+  while (si < name_len) {
+    if (pi < p->count) {
+      const struct pat_op *op = &p->ops[pi];
+      unsigned char c = name[si];
+      int ok = 0;
+
+      switch (op->type) {
+        case PAT_STAR:
+          have_star = 1;
+          star_pi = ++pi;
+          star_si = si;
+          continue;
+        case PAT_ANY:
+          ok = 1;
+          break;
+        case PAT_CHAR:
+          ok = op->c == c;
+          break;
+        case PAT_CLASS:
+          ok = (op->set[c >> 3] >> (c & 7)) & 1;
+          break;
+      }
+
+      if (ok) {
+        pi++;
+        si++;
+        continue;
+      }
+    }
+
+    // mismatch: let the last star swallow one more character
+    if (!have_star) {
+      return 0;
+    }
+    pi = star_pi;
+    si = ++star_si;
+  }
+
+  // only trailing stars may be left over
+  while (pi < p->count && p->ops[pi].type == PAT_STAR) {
+    pi++;
+  }
+  return pi == p->count;
+}
+
+/** Does the given string contain any glob characters? */
+int glob_has_magic(const char *pattern) {
+  return strpbrk(pattern, "*?[") != NULL;
+}
+
+// Does the first len characters of the given component contain glob characters?
+static int has_magic(const char *component, unsigned int len) {
+  for (unsigned int i = 0; i < len; i++) {
+    if (component[i] == '*' || component[i] == '?' || component[i] == '[') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// ============================= LISTINGS ==============================
+
+/** An entry of a directory listing. */
+struct entry {
+  unsigned int offset;       /* Offset of the name in the listing's names. */
+  unsigned char type;        /* d_type as reported by getdents64. */
+};
+
+/** A cached directory listing. */
+struct listing {
+  dev_t dev;                 /* Device and inode identify the directory... */
+  ino_t ino;
+  struct timespec mtime;     /* ...and its mtime tells us if it changed. */
+  int racy;                  /* Was it modified too recently to trust mtime? */
+  char *names;               /* Every name back to back, null terminated. */
+  struct entry *entries;     /* The entries, sorted by name. */
+  unsigned int count;        /* Number of entries. */
+  unsigned long last_used;   /* For evicting the least recently used listing. */
+  int valid;                 /* Is this slot in use? */
+};
+
+static struct listing cache[GLOB_CACHE_SLOTS];
+static unsigned long cache_clock;
+
+// Free the memory held by a listing and mark its slot unused
+static void listing_clear(struct listing *l) {
+  free(l->names);
+  free(l->entries);
+  memset(l, 0, sizeof(*l));
+}
+
+/** Drop every cached directory listing. */
+void glob_cache_clear(void) {
+  for (int i = 0; i < GLOB_CACHE_SLOTS; i++) {
+    listing_clear(&cache[i]);
+  }
+}
+
+// qsort_r comparator for entries whose names live in the given buffer
+static int compare_entries(const void *a, const void *b, void *names) {
+  return strcmp((char *) names + ((const struct entry *) a)->offset,
+                (char *) names + ((const struct entry *) b)->offset);
+}
+
+// Read the directory open on fd into the given (cleared) listing. Returns 0
+// on success and -1 on error.
+static int listing_read(struct listing *l, int fd) {
+  char *buf = (char *) malloc(GLOB_READ_SIZE);
+  if (buf == NULL) {
+    return -1;
+  }
+
+  unsigned int names_cap = 4096;
+  unsigned int names_len = 0;
+  unsigned int entries_cap = 64;
+  l->names = (char *) malloc(names_cap);
+  l->entries = (struct entry *) malloc(entries_cap * sizeof(struct entry));
+  assert(l->names != NULL && l->entries != NULL);
+
+  ssize_t nread;
+  while ((nread = getdents64(fd, buf, GLOB_READ_SIZE)) > 0) {
+    for (ssize_t pos = 0; pos < nread; ) {
+      struct dirent64 *d = (struct dirent64 *) (buf + pos);
+      pos += d->d_reclen;
+
+      const char *name = d->d_name;
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+
+      unsigned int len = strlen(name) + 1;
+      if (names_len + len > names_cap) {
+        while (names_len + len > names_cap) {
+          names_cap *= 2;
+        }
+        l->names = (char *) realloc(l->names, names_cap);
+        assert(l->names != NULL);
+      }
+      if (l->count == entries_cap) {
+        entries_cap *= 2;
+        l->entries = (struct entry *) realloc(l->entries, entries_cap * sizeof(struct entry));
+        assert(l->entries != NULL);
+      }
+
+      memcpy(l->names + names_len, name, len);
+      l->entries[l->count].offset = names_len;
+      l->entries[l->count].type = d->d_type;
+      l->count++;
+      names_len += len;
+    }
+  }
+  free(buf);
+
+  if (nread < 0) {
+    listing_clear(l);
+    return -1;
+  }
+
+  // Sort once here so that every expansion served from this listing comes
+  // out already in order
+  qsort_r(l->entries, l->count, sizeof(struct entry), compare_entries, l->names);
+
+  // give back what the doubling over-allocated
+  l->names = (char *) realloc(l->names, names_len + 1);
+  l->entries = (struct entry *) realloc(l->entries, l->count * sizeof(struct entry) + 1);
+  return 0;
+}
+
+// Get the listing of the given directory, reading it only if it isn't cached
+// or has changed since it was cached. Returns NULL if it can't be read.
+static struct listing *listing_get(const char *dir) {
+  struct stat st;
+  if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+    return NULL;
+  }
+
+  cache_clock++;
+  struct listing *victim = &cache[0];
+  for (int i = 0; i < GLOB_CACHE_SLOTS; i++) {
+    struct listing *l = &cache[i];
+    if (l->valid && l->dev == st.st_dev && l->ino == st.st_ino) {
+      if (!l->racy && l->mtime.tv_sec == st.st_mtim.tv_sec
+          && l->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        l->last_used = cache_clock;
+        return l;
+      }
+      // stale, so reread it into the same slot
+      victim = l;
+      break;
+    }
+    if (!l->valid || (victim->valid && l->last_used < victim->last_used)) {
+      victim = l;
+    }
+  }
+
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  listing_clear(victim);
+  int result = listing_read(victim, fd);
+  close(fd);
+  if (result == -1) {
+    return NULL;
+  }
+
+  victim->valid = 1;
+  victim->dev = st.st_dev;
+  victim->ino = st.st_ino;
+  victim->mtime = st.st_mtim;
+  // A change made within the same timestamp tick as our read wouldn't move
+  // the mtime, so a directory modified this recently is read again next time.
+  victim->racy = st.st_mtim.tv_sec >= now.tv_sec - 1;
+  victim->last_used = cache_clock;
+  return victim;
+}
+
+// ============================= EXPANSION =============================
+
+/** A growable array of paths. */
+struct pathlist {
+  char **data;
+  unsigned int size;
+  unsigned int capacity;
+};
+
+// Add a path made of prefix followed by the first len characters of name
+// (and a trailing slash if asked for)
+static void pathlist_add(struct pathlist *pl, const char *prefix, const char *name,
+                         unsigned int len, int slash) {
+  if (pl->size == pl->capacity) {
+    pl->capacity = pl->capacity ? pl->capacity * 2 : 16;
+    pl->data = (char **) realloc(pl->data, pl->capacity * sizeof(char *));
+    assert(pl->data != NULL);
+  }
+  unsigned int prefix_len = strlen(prefix);
+  char *path = (char *) malloc(prefix_len + len + 2);
+  assert(path != NULL);
+  memcpy(path, prefix, prefix_len);
+  memcpy(path + prefix_len, name, len);
+  path[prefix_len + len] = '/';
+  path[prefix_len + len + slash] = '\0';
+  pl->data[pl->size++] = path;
+}
+
+// Free every path in the list along with the list itself
+static void pathlist_free(struct pathlist *pl) {
+  for (unsigned int i = 0; i < pl->size; i++) {
+    free(pl->data[i]);
+  }
+  free(pl->data);
+  pl->data = NULL;
+  pl->size = pl->capacity = 0;
+}
+
+// Is the given entry of the listing (found under prefix) a directory?
+static int entry_is_dir(struct listing *l, unsigned int idx, const char *prefix) {
+  unsigned char type = l->entries[idx].type;
+  if (type == DT_DIR) {
+    return 1;
+  }
+  if (type != DT_LNK && type != DT_UNKNOWN) {
+    return 0;
+  }
+  // symlinks and file systems that don't report types need a stat
+  const char *name = l->names + l->entries[idx].offset;
+  unsigned int prefix_len = strlen(prefix);
+  char path[prefix_len + strlen(name) + 1];
+  memcpy(path, prefix, prefix_len);
+  strcpy(path + prefix_len, name);
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// qsort comparator for an array of strings
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/** Expand a pathname pattern. */
+unsigned int glob_expand(const char *pattern, char ***matches) {
+  // Paths matched so far; each one ends with a '/' ready for the next
+  // component. We start from the root or the current directory.
+  struct pathlist current = { NULL, 0, 0 };
+  struct pathlist next = { NULL, 0, 0 };
+  const char *p = pattern;
+  pathlist_add(&current, "", "/", *p == '/', 0);
+  while (*p == '/') {
+    p++;
+  }
+
+  int any_magic = 0;
+  // did plain components follow the last pattern? (their paths may not exist)
+  int plain_tail = 0;
+  int sorted = 1;
+  while (*p != '\0' && current.size > 0) {
+    unsigned int len = strcspn(p, "/");
+    const char *rest = p + len;
+    while (*rest == '/') {
+      rest++;
+    }
+    // every component except the last has to be a directory; so does the
+    // last one if the pattern ends with a slash
+    int want_dir = *rest != '\0' || p[len] == '/';
+
+    if (!has_magic(p, len)) {
+      // a plain component is just appended; whether the path exists is
+      // checked once at the end
+      for (unsigned int i = 0; i < current.size; i++) {
+        pathlist_add(&next, current.data[i], p, len, want_dir);
+      }
+      plain_tail = any_magic;
+    }
+    else {
+      struct pattern pat;
+      pattern_compile(&pat, p, len);
+      any_magic = 1;
+      plain_tail = 0;
+      // matches from more than one directory need a final sort
+      sorted = sorted && current.size == 1;
+
+      for (unsigned int i = 0; i < current.size; i++) {
+        const char *dir = current.data[i][0] != '\0' ? current.data[i] : ".";
+        struct listing *l = listing_get(dir);
+        if (l == NULL) {
+          continue;
+        }
+        for (unsigned int j = 0; j < l->count; j++) {
+          const char *name = l->names + l->entries[j].offset;
+          unsigned int name_len = strlen(name);
+          if (pattern_match(&pat, name, name_len)
+              && (!want_dir || entry_is_dir(l, j, current.data[i]))) {
+            pathlist_add(&next, current.data[i], name, name_len, want_dir);
+          }
+        }
+      }
+      free(pat.ops);
+    }
+
+    pathlist_free(&current);
+    current = next;
+    next.data = NULL;
+    next.size = next.capacity = 0;
+    p = rest;
+  }
+
+  if (!any_magic) {
+    pathlist_free(&current);
+    *matches = NULL;
+    return 0;
+  }
+
+  // drop results whose trailing plain components don't exist
+  if (plain_tail) {
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < current.size; i++) {
+      struct stat st;
+      if (lstat(current.data[i], &st) == 0) {
+        current.data[kept++] = current.data[i];
+      }
+      else {
+        free(current.data[i]);
+      }
+    }
+    current.size = kept;
+  }
+
+  if (current.size == 0) {
+    pathlist_free(&current);
+    *matches = NULL;
+    return 0;
+  }
+
+  if (!sorted) {
+    qsort(current.data, current.size, sizeof(char *), compare_paths);
+  }
+  *matches = current.data;
+  return current.size;
+}
@@ -0,0 +1,26 @@
+#ifndef _GLOBEXP_H
+#define _GLOBEXP_H
+
+/** Does the given string contain any glob characters (*, ? or [)? */
+int glob_has_magic(const char *pattern);
+
+/** Expand a pathname pattern such as "src/main.[ch]". Returns the number of
+ *  matching paths and sets *matches to a sorted array of them. The caller
+ *  owns the array and every path in it, and is responsible for freeing them.
+ *  Returns 0 (and sets *matches to NULL) if nothing matches. */
+unsigned int glob_expand(const char *pattern, char ***matches);
+
+/** Drop every cached directory listing. */
+void glob_cache_clear(void);
+
+
+/* Pathname expansion configuration. */
+
+/* Number of directory listings kept between expansions. A listing is reused
+ * as long as its directory's (device, inode, mtime) is unchanged. */
+#define GLOB_CACHE_SLOTS 32
+
+/* Size of the buffer handed to each getdents64 call. */
+#define GLOB_READ_SIZE (256 * 1024)
+
+#endif /* ifndef _GLOBEXP_H */
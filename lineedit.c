@@ -0,0 +1,560 @@
+/**
+ * Line editor for interactive input.
+ *
+ * While a line is being read the terminal is put in raw mode and every key
+ * is handled here: moving around and editing the line, going through the
+ * history and tab completion. The line is redrawn with a single write after
+ * each key; if it's wider than the terminal, only the part around the
+ * cursor is shown.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "lineedit.h"
+
+/** A line editor. */
+struct lineedit {
+  int in;                    /* Where keys are read from... */
+  int out;                   /* ...and where the line is drawn. */
+  lineedit_complete_t complete;
+  struct termios saved;      /* Terminal settings to restore. */
+
+  char **history;            /* Oldest first. While a line is being read, */
+  unsigned int history_len;  /* the last entry is the line as edited. */
+  unsigned int history_pos;  /* How far back from the end we are. */
+
+  const char *prompt;
+  char *buf;                 /* The line (not null terminated). */
+  size_t len;
+  size_t cap;
+  size_t pos;                /* Where the cursor is in it. */
+  int tabbed;                /* Was the last key a tab? */
+};
+
+/** Output gathered to be written at once. */
+struct outbuf {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+static void out_append(struct outbuf *ob, const char *data, size_t len) {
+  if (ob->len + len > ob->cap) {
+    ob->cap = (ob->len + len) * 2;
+    ob->data = (char *) realloc(ob->data, ob->cap);
+    assert(ob->data != NULL);
+  }
+  memcpy(ob->data + ob->len, data, len);
+  ob->len += len;
+}
+
+static void out_str(struct outbuf *ob, const char *str) {
+  out_append(ob, str, strlen(str));
+}
+
+// Write everything and empty the buffer
+static void out_flush(struct outbuf *ob, int fd) {
+  size_t done = 0;
+  while (done < ob->len) {
+    ssize_t n = write(fd, ob->data + done, ob->len - done);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      break;
+    }
+    done += n;
+  }
+  ob->len = 0;
+}
+
+static void write_str(lineedit_t *ed, const char *str) {
+  struct outbuf ob = { (char *) str, strlen(str), 0 };
+  out_flush(&ob, ed->out);
+}
+
+// ============================= TERMINAL ==============================
+
+// Put the terminal in raw mode. Returns 0 on success, -1 on error.
+static int raw_enable(lineedit_t *ed) {
+  if (tcgetattr(ed->in, &ed->saved) == -1) {
+    return -1;
+  }
+  struct termios raw = ed->saved;
+  // no translating of input, echoing, waiting for whole lines or signals
+  // from keys (ctrl-c only abandons the line being edited); output is still
+  // post-processed so that "\n" moves to the start of the next line
+  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  raw.c_cflag |= CS8;
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  return tcsetattr(ed->in, TCSADRAIN, &raw);
+}
+
+static void raw_disable(lineedit_t *ed) {
+  tcsetattr(ed->in, TCSADRAIN, &ed->saved);
+}
+
+// The width of the terminal
+static size_t columns(lineedit_t *ed) {
+  struct winsize ws;
+  if (ioctl(ed->out, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+    return 80;
+  }
+  return ws.ws_col;
+}
+
+// Read a byte of input. Returns -1 at the end of the input.
+static int read_byte(lineedit_t *ed) {
+  unsigned char c;
+  while (1) {
+    ssize_t n = read(ed->in, &c, 1);
+    if (n == 1) {
+      return c;
+    }
+    if (n == 0 || errno != EINTR) {
+      return -1;
+    }
+  }
+}
+
+// Redraw the prompt and the line, with the cursor in place
+static void refresh(lineedit_t *ed) {
+  size_t promptLen = strlen(ed->prompt);
+  size_t cols = columns(ed);
+  const char *buf = ed->buf;
+  size_t len = ed->len;
+  size_t pos = ed->pos;
+
+  // scroll the line sideways to keep the cursor on screen
+  while (promptLen + pos >= cols && pos > 0) {
+    buf++;
+    len--;
+    pos--;
+  }
+  while (promptLen + len > cols && len > pos) {
+    len--;
+  }
+
+  struct outbuf ob = { NULL, 0, 0 };
+  char move[32];
+  out_str(&ob, "\r");
+  out_str(&ob, ed->prompt);
+  out_append(&ob, buf, len);
+  // clear the rest of the row and put the cursor back
+  snprintf(move, sizeof(move), "\x1b[0K\r\x1b[%zuC", promptLen + pos);
+  out_str(&ob, move);
+  out_flush(&ob, ed->out);
+  free(ob.data);
+}
+
+// ============================== EDITING ==============================
+
+// Make room for at least len bytes in the line
+static void reserve(lineedit_t *ed, size_t len) {
+  if (len + 1 > ed->cap) {
+    ed->cap = (len + 1) * 2;
+    ed->buf = (char *) realloc(ed->buf, ed->cap);
+    assert(ed->buf != NULL);
+  }
+}
+
+// Replace the characters from start to the cursor with len bytes of text,
+// leaving the cursor after them
+static void replace(lineedit_t *ed, size_t start, const char *text, size_t len) {
+  reserve(ed, ed->len - (ed->pos - start) + len);
+  memmove(ed->buf + start + len, ed->buf + ed->pos, ed->len - ed->pos);
+  memcpy(ed->buf + start, text, len);
+  ed->len = ed->len - (ed->pos - start) + len;
+  ed->pos = start + len;
+}
+
+// Delete the characters from start to end
+static void erase(lineedit_t *ed, size_t start, size_t end) {
+  memmove(ed->buf + start, ed->buf + end, ed->len - end);
+  ed->len -= end - start;
+  if (ed->pos > end) {
+    ed->pos -= end - start;
+  }
+  else if (ed->pos > start) {
+    ed->pos = start;
+  }
+}
+
+// Replace the line with a copy of str
+static void set_line(lineedit_t *ed, const char *str) {
+  size_t len = strlen(str);
+  reserve(ed, len);
+  memcpy(ed->buf, str, len);
+  ed->len = ed->pos = len;
+}
+
+// Move back (dir 1) or forward (dir -1) through the history
+static void history_move(lineedit_t *ed, int dir) {
+  if (ed->history_len < 2) {
+    return;
+  }
+  if ((dir > 0 && ed->history_pos == ed->history_len - 1) || (dir < 0 && ed->history_pos == 0)) {
+    return;
+  }
+
+  // keep any changes made to this entry until the line is done
+  char **entry = &ed->history[ed->history_len - 1 - ed->history_pos];
+  free(*entry);
+  *entry = strndup(ed->buf, ed->len);
+  assert(*entry != NULL);
+
+  ed->history_pos += dir;
+  set_line(ed, ed->history[ed->history_len - 1 - ed->history_pos]);
+}
+
+// The part of a completion to list: the last component of a path
+static const char *display_name(const char *word, size_t *len) {
+  size_t end = strlen(word);
+  size_t start = end > 0 ? end - 1 : 0;
+  while (start > 0 && word[start - 1] != '/') {
+    start--;
+  }
+  *len = end - start;
+  return word + start;
+}
+
+// List the completions in columns under the line
+static void list_matches(lineedit_t *ed, char **matches, unsigned int count) {
+  if (count > LINEEDIT_LIST_MAX) {
+    char question[64];
+    snprintf(question, sizeof(question), "\nDisplay all %u possibilities? (y or n)", count);
+    write_str(ed, question);
+    int c = read_byte(ed);
+    if (c != 'y' && c != 'Y') {
+      write_str(ed, "\n");
+      refresh(ed);
+      return;
+    }
+  }
+
+  size_t width = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    size_t len;
+    display_name(matches[i], &len);
+    if (len > width) {
+      width = len;
+    }
+  }
+  width += 2;
+  size_t cols = columns(ed) / width;
+  if (cols == 0) {
+    cols = 1;
+  }
+  size_t rows = (count + cols - 1) / cols;
+
+  // down the columns, like ls
+  struct outbuf ob = { NULL, 0, 0 };
+  out_str(&ob, "\n");
+  for (size_t r = 0; r < rows; r++) {
+    for (size_t c = 0; c < cols && c * rows + r < count; c++) {
+      size_t len;
+      const char *name = display_name(matches[c * rows + r], &len);
+      out_append(&ob, name, len);
+      if ((c + 1) * rows + r < count) {
+        for (size_t pad = len; pad < width; pad++) {
+          out_append(&ob, " ", 1);
+        }
+      }
+    }
+    out_str(&ob, "\n");
+  }
+  out_flush(&ob, ed->out);
+  free(ob.data);
+  refresh(ed);
+}
+
+// Complete the word before the cursor: all the way if there's only one
+// way to, otherwise as far as all the completions agree. A second tab in a
+// row that can't complete any further lists them.
+static void complete(lineedit_t *ed) {
+  if (ed->complete == NULL) {
+    write_str(ed, "\a");
+    return;
+  }
+
+  reserve(ed, ed->len);
+  ed->buf[ed->len] = '\0';
+  unsigned int start;
+  char **matches;
+  unsigned int count = ed->complete(ed->buf, ed->pos, &start, &matches);
+  if (count == 0) {
+    write_str(ed, "\a");
+    return;
+  }
+
+  size_t common = strlen(matches[0]);
+  for (unsigned int i = 1; i < count; i++) {
+    size_t j = 0;
+    while (j < common && matches[i][j] == matches[0][j]) {
+      j++;
+    }
+    common = j;
+  }
+
+  if (count == 1) {
+    replace(ed, start, matches[0], common);
+    // a finished word gets a space after it, a directory doesn't
+    if (common == 0 || matches[0][common - 1] != '/') {
+      replace(ed, ed->pos, " ", 1);
+    }
+    refresh(ed);
+  }
+  else if (common > ed->pos - start) {
+    replace(ed, start, matches[0], common);
+    refresh(ed);
+  }
+  else if (ed->tabbed) {
+    list_matches(ed, matches, count);
+  }
+  else {
+    write_str(ed, "\a");
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    free(matches[i]);
+  }
+  free(matches);
+}
+
+// Handle the rest of an escape sequence (the arrow keys and the like)
+static void escape(lineedit_t *ed) {
+  int first = read_byte(ed);
+  int second = read_byte(ed);
+  if (first != '[' && first != 'O') {
+    return;
+  }
+  if (second >= '0' && second <= '9') {
+    // ESC [ n ~
+    if (read_byte(ed) != '~') {
+      return;
+    }
+    if (second == '3' && ed->pos < ed->len) {
+      erase(ed, ed->pos, ed->pos + 1);
+    }
+    else if (second == '1' || second == '7') {
+      ed->pos = 0;
+    }
+    else if (second == '4' || second == '8') {
+      ed->pos = ed->len;
+    }
+    return;
+  }
+
+  switch (second) {
+    case 'A':
+      history_move(ed, 1);
+      break;
+    case 'B':
+      history_move(ed, -1);
+      break;
+    case 'C':
+      if (ed->pos < ed->len) {
+        ed->pos++;
+      }
+      break;
+    case 'D':
+      if (ed->pos > 0) {
+        ed->pos--;
+      }
+      break;
+    case 'H':
+      ed->pos = 0;
+      break;
+    case 'F':
+      ed->pos = ed->len;
+      break;
+  }
+}
+
+// ================================ API ================================
+
+/** Create a line editor. */
+lineedit_t *lineedit_new(int in, int out, lineedit_complete_t complete) {
+  lineedit_t *ed = (lineedit_t *) calloc(1, sizeof(lineedit_t));
+  assert(ed != NULL);
+  ed->in = in;
+  ed->out = out;
+  ed->complete = complete;
+  ed->history = (char **) malloc((LINEEDIT_HISTORY_MAX + 1) * sizeof(char *));
+  assert(ed->history != NULL);
+  return ed;
+}
+
+/** Free a line editor and its history. */
+void lineedit_delete(lineedit_t *ed) {
+  if (ed == NULL) {
+    return;
+  }
+  for (unsigned int i = 0; i < ed->history_len; i++) {
+    free(ed->history[i]);
+  }
+  free(ed->history);
+  free(ed->buf);
+  free(ed);
+}
+
+/** Add a line to the history. */
+void lineedit_history_add(lineedit_t *ed, const char *line) {
+  if (ed->history_len > 0 && strcmp(ed->history[ed->history_len - 1], line) == 0) {
+    return;
+  }
+  if (ed->history_len == LINEEDIT_HISTORY_MAX) {
+    free(ed->history[0]);
+    memmove(ed->history, ed->history + 1, (ed->history_len - 1) * sizeof(char *));
+    ed->history_len--;
+  }
+  ed->history[ed->history_len] = strdup(line);
+  assert(ed->history[ed->history_len] != NULL);
+  ed->history_len++;
+}
+
+/** Let the user edit a line until they press enter. */
+char *lineedit_read(lineedit_t *ed, const char *prompt) {
+  ed->prompt = prompt;
+  ed->len = ed->pos = 0;
+  ed->tabbed = 0;
+  reserve(ed, 0);
+
+  int raw = raw_enable(ed) == 0;
+  write_str(ed, prompt);
+
+  // the line being edited is the newest entry while it's being edited
+  ed->history[ed->history_len] = strdup("");
+  assert(ed->history[ed->history_len] != NULL);
+  ed->history_len++;
+  ed->history_pos = 0;
+
+  int eof = 0;
+  while (1) {
+    int c = read_byte(ed);
+    if (c == -1) {
+      eof = ed->len == 0;
+      break;
+    }
+    if (c == '\r' || c == '\n') {
+      break;
+    }
+    if (!raw) {
+      // not a terminal: just collect the line
+      reserve(ed, ed->len + 1);
+      ed->buf[ed->len++] = c;
+      continue;
+    }
+
+    int tab = 0;
+    switch (c) {
+      case 1:    // ctrl-a
+        ed->pos = 0;
+        break;
+      case 2:    // ctrl-b
+        if (ed->pos > 0) {
+          ed->pos--;
+        }
+        break;
+      case 3:    // ctrl-c: start over on a new line
+        ed->pos = ed->len;
+        refresh(ed);
+        write_str(ed, "^C\n");
+        ed->len = ed->pos = 0;
+        ed->history_pos = 0;
+        break;
+      case 4:    // ctrl-d: the end of input on an empty line
+        if (ed->len == 0) {
+          eof = 1;
+        }
+        else if (ed->pos < ed->len) {
+          erase(ed, ed->pos, ed->pos + 1);
+        }
+        break;
+      case 5:    // ctrl-e
+        ed->pos = ed->len;
+        break;
+      case 6:    // ctrl-f
+        if (ed->pos < ed->len) {
+          ed->pos++;
+        }
+        break;
+      case 8:    // ctrl-h or backspace
+      case 127:
+        if (ed->pos > 0) {
+          erase(ed, ed->pos - 1, ed->pos);
+        }
+        break;
+      case 9:    // tab
+        complete(ed);
+        tab = 1;
+        break;
+      case 11:   // ctrl-k: delete to the end of the line
+        ed->len = ed->pos;
+        break;
+      case 12:   // ctrl-l: clear the screen
+        write_str(ed, "\x1b[H\x1b[2J");
+        break;
+      case 14:   // ctrl-n
+        history_move(ed, -1);
+        break;
+      case 16:   // ctrl-p
+        history_move(ed, 1);
+        break;
+      case 21:   // ctrl-u: delete to the start of the line
+        erase(ed, 0, ed->pos);
+        break;
+      case 23: { // ctrl-w: delete the word before the cursor
+        size_t start = ed->pos;
+        while (start > 0 && ed->buf[start - 1] == ' ') {
+          start--;
+        }
+        while (start > 0 && ed->buf[start - 1] != ' ') {
+          start--;
+        }
+        erase(ed, start, ed->pos);
+        break;
+      }
+      case 27:
+        escape(ed);
+        break;
+      default:
+        if (c >= 32) {
+          char ch = c;
+          replace(ed, ed->pos, &ch, 1);
+        }
+        break;
+    }
+    if (eof) {
+      break;
+    }
+    ed->tabbed = tab;
+    if (!tab) {
+      refresh(ed);
+    }
+  }
+
+  ed->history_len--;
+  free(ed->history[ed->history_len]);
+
+  if (raw) {
+    ed->pos = ed->len;
+    refresh(ed);
+    raw_disable(ed);
+    write_str(ed, "\n");
+  }
+  if (eof) {
+    return NULL;
+  }
+  char *line = strndup(ed->buf, ed->len);
+  assert(line != NULL);
+  return line;
+}
@@ -0,0 +1,40 @@
+#ifndef _LINEEDIT_H
+#define _LINEEDIT_H
+
+/** A line editor reading from a terminal. */
+typedef struct lineedit lineedit_t;
+
+/** Completion callback: find the words the word ending at position cursor
+ *  of line could be completed to, setting *start to where that word starts
+ *  and *matches to a sorted array of the words (see complete_word). The
+ *  editor frees the array and the words in it. */
+typedef unsigned int (*lineedit_complete_t)(const char *line, unsigned int cursor,
+                                            unsigned int *start, char ***matches);
+
+/** Create a line editor that reads keys from fd in and draws on fd out,
+ *  using complete (which may be NULL) for tab completion. */
+lineedit_t *lineedit_new(int in, int out, lineedit_complete_t complete);
+
+/** Free a line editor and its history. */
+void lineedit_delete(lineedit_t *ed);
+
+/** Show the prompt and let the user edit a line until they press enter.
+ *  The terminal is only in raw mode while this runs. Returns the line
+ *  (without a newline), which the caller frees, or NULL if the user pressed
+ *  ctrl-d on an empty line or the input ended. */
+char *lineedit_read(lineedit_t *ed, const char *prompt);
+
+/** Add a line to the history that the up and down keys go through (unless
+ *  it's the same as the last one). */
+void lineedit_history_add(lineedit_t *ed, const char *line);
+
+
+/* Line editor configuration. */
+
+/* Number of lines kept in the history; the oldest go first. */
+#define LINEEDIT_HISTORY_MAX 1000
+
+/* With more completions than this, ask before listing them all. */
+#define LINEEDIT_LIST_MAX 100
+
+#endif /* ifndef _LINEEDIT_H */
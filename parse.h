@@ -4,6 +4,9 @@
 #include <assert.h>
 
 #include "strarr.h"
+#include "env.h"
+#include "globexp.h"
+#include "arith.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -11,9 +14,15 @@
 #include <unistd.h>
 #include <errno.h>
 
-// ============================= CONSTANTS =============================
+#include "alloc.h"
 
-const unsigned int MAX_EXPR_LEN = 256;
+// ============================== HOOKS ================================
+
+// Runs the command of a $( ... ) substitution (the first len characters of
+// cmd) and returns everything it wrote to its stdout, setting *out_len to
+// the length. The caller owns the returned buffer. Set by the shell; while
+// it's NULL, substitutions are left as they are.
+char *(*run_substitution)(const char *cmd, unsigned int len, unsigned int *out_len) = NULL;
 
 // ============================== HELPERS ==============================
 
@@ -27,48 +36,315 @@ int is_whitespace(char c) {
   return c == ' ' || c == '\n' || c == '\t' || c == '\r';
 }
 
+// Growable character buffer used to assemble a token whose final length
+// isn't known up front (a variable can expand to more than its name)
+typedef struct wordbuf {
+  char *data;
+  unsigned int len;
+  unsigned int cap;
+} wordbuf_t;
+
+// Append n characters to the buffer, keeping it null terminated
+void wordbuf_append(wordbuf_t *wb, const char *str, unsigned int n) {
+  if (wb->len + n + 1 > wb->cap) {
+    unsigned int cap = wb->cap ? wb->cap : 32;
+    while (cap < wb->len + n + 1) {
+      cap *= 2;
+    }
+    wb->data = (char *)realloc(wb->data, cap);
+    assert(wb->data != NULL);
+    wb->cap = cap;
+  }
+  memcpy(wb->data + wb->len, str, n);
+  wb->len += n;
+  wb->data[wb->len] = '\0';
+}
+
+// Expand the $NAME or ${NAME} reference at the start of the input into the
+// output buffer. Unset variables expand to nothing, and a '$' that doesn't
+// start a reference is kept as is. Returns the number of characters consumed.
+int expand_variable(const char *input, wordbuf_t *output, env_t *env) {
+  int braced = input[1] == '{';
+  const char *name = &input[1 + braced];
+  // $? (the last exit status) is the one name that isn't an identifier
+  unsigned int len = name[0] == '?' ? 1 : env_name_len(name);
+
+  if (len == 0 || (braced && name[len] != '}')) {
+    wordbuf_append(output, "$", 1);
+    return 1;
+  }
+
+  // env_get wants a null terminated name
+  char name_copy[len + 1];
+  memcpy(name_copy, name, len);
+  name_copy[len] = '\0';
+
+  const char *value = env_get(env, name_copy);
+  if (value != NULL) {
+    wordbuf_append(output, value, strlen(value));
+  }
+  return 1 + len + 2 * braced;
+}
+
+// Get the length of the $(( expression )) at the start of the input, or 0
+// if the input doesn't hold a complete arithmetic expansion
+int arithmetic_len(const char *input) {
+  // find the "))" that closes the expansion, skipping over nested parentheses
+  int depth = 0;
+  int i = 3;
+  while (input[i] != '\0' && input[i] != '\n') {
+    if (input[i] == '(') {
+      depth++;
+    }
+    else if (input[i] == ')') {
+      if (depth == 0) {
+        break;
+      }
+      depth--;
+    }
+    i++;
+  }
+  if (input[i] != ')' || input[i + 1] != ')') {
+    return 0;
+  }
+  return i + 2;
+}
+
+// Evaluate the arithmetic expansion of the given length at the start of the
+// input and append the result to the output buffer
+void expand_arithmetic(const char *input, int len, wordbuf_t *output, env_t *env) {
+  // the expression sits between "$((" and "))"
+  const char *expr = &input[3];
+  int exprLen = len - 5;
+
+  long long value;
+  const char *error;
+  if (arith_eval(expr, exprLen, env, &value, &error) == -1) {
+    fprintf(stderr, "%.*s: %s\n", exprLen, expr, error);
+  }
+  else {
+    char digits[24];
+    int n = snprintf(digits, sizeof(digits), "%lld", value);
+    wordbuf_append(output, digits, n);
+  }
+}
+
+// Get the length of the $( command ) at the start of the input, or 0 if the
+// input doesn't hold a complete command substitution
+int substitution_len(const char *input) {
+  // find the matching ")", skipping over nested parentheses (which includes
+  // nested substitutions) and anything in double quotes
+  int depth = 0;
+  int i = 2;
+  while (input[i] != '\0' && input[i] != '\n') {
+    if (input[i] == '"') {
+      i++;
+      while (input[i] != '"' && input[i] != '\0' && input[i] != '\n') {
+        i++;
+      }
+      if (input[i] != '"') {
+        return 0;
+      }
+    }
+    else if (input[i] == '(') {
+      depth++;
+    }
+    else if (input[i] == ')') {
+      if (depth == 0) {
+        return i + 1;
+      }
+      depth--;
+    }
+    i++;
+  }
+  return 0;
+}
+
+// Hand the word assembled so far over to the token array (if it isn't
+// empty) and start a new one
+void flush_word(wordbuf_t *word, strarr_t *tokens) {
+  if (word->len) {
+    strarr_take(tokens, word->data);
+    word->data = NULL;
+    word->len = 0;
+    word->cap = 0;
+  }
+}
+
+// Add a finished word to the token array, which takes it over. If glob is
+// set and the word is a pattern, the paths it matches go in instead (in
+// order); a pattern that matches nothing is kept as it is.
+void add_word(strarr_t *tokens, char *word, int glob) {
+  char **matches;
+  unsigned int num_matches = 0;
+  if (glob && glob_has_magic(word)) {
+    num_matches = glob_expand(word, &matches);
+  }
+  if (num_matches == 0) {
+    strarr_take(tokens, word);
+    return;
+  }
+  strarr_reserve(tokens, tokens->size + num_matches);
+  for (unsigned int j = 0; j < num_matches; j++) {
+    strarr_take(tokens, matches[j]);
+  }
+  free(matches);
+  free(word);
+}
+
+// Append text to the word being assembled, splitting it into words at
+// whitespace: every word it ends (including whatever preceded the text) is
+// added to tokens
+void split_words(const char *text, unsigned int len, wordbuf_t *output, strarr_t *tokens) {
+  unsigned int i = 0;
+  while (i < len) {
+    if (is_whitespace(text[i])) {
+      flush_word(output, tokens);
+      while (i < len && is_whitespace(text[i])) {
+        i++;
+      }
+      continue;
+    }
+    unsigned int start = i;
+    while (i < len && !is_whitespace(text[i])) {
+      i++;
+    }
+    wordbuf_append(output, &text[start], i - start);
+  }
+}
+
+// Run the command substitution of the given length at the start of the input
+// and append its output (minus trailing newlines) to the output buffer. If
+// tokens is not NULL (an unquoted substitution), the output is split into
+// words at whitespace, and every word but the last is added to tokens.
+void expand_substitution(const char *input, int len, wordbuf_t *output, strarr_t *tokens) {
+  unsigned int outLen;
+  char *out = run_substitution(&input[2], len - 3, &outLen);
+  while (outLen > 0 && out[outLen - 1] == '\n') {
+    outLen--;
+  }
+
+  if (tokens == NULL) {
+    if (output->len == 0) {
+      // the output is the whole word so far, so take the buffer over
+      // rather than copying it
+      free(output->data);
+      out[outLen] = '\0';
+      output->data = out;
+      output->len = outLen;
+      output->cap = outLen + 1;
+      return;
+    }
+    wordbuf_append(output, out, outLen);
+    free(out);
+    return;
+  }
+
+  split_words(out, outLen, output, tokens);
+  free(out);
+}
+
+// Expand the $ expansion at the start of the input into the output buffer.
+// If env is NULL, the expansion is copied as it is. Unquoted command
+// substitutions (tokens is not NULL) can produce several words; all but the
+// last are added to tokens. So can unquoted variables if splitVars is set.
+// Returns the number of characters consumed.
+int expand_dollar(const char *input, wordbuf_t *output, env_t *env, strarr_t *tokens,
+                  int splitVars) {
+  if (input[1] == '(' && input[2] == '(') {
+    int len = arithmetic_len(input);
+    if (len && env == NULL) {
+      wordbuf_append(output, input, len);
+      return len;
+    }
+    else if (len) {
+      expand_arithmetic(input, len, output, env);
+      return len;
+    }
+  }
+  if (input[1] == '(') {
+    int len = substitution_len(input);
+    if (len && (env == NULL || run_substitution == NULL)) {
+      wordbuf_append(output, input, len);
+      return len;
+    }
+    else if (len) {
+      expand_substitution(input, len, output, tokens);
+      return len;
+    }
+  }
+  if (env == NULL) {
+    wordbuf_append(output, "$", 1);
+    return 1;
+  }
+  if (tokens != NULL && splitVars) {
+    wordbuf_t value = { NULL, 0, 0 };
+    int len = expand_variable(input, &value, env);
+    split_words(value.data, value.len, output, tokens);
+    free(value.data);
+    return len;
+  }
+  return expand_variable(input, output, env);
+}
+
 // Read a sequence of non-special characters from an input string,
-// and write them to an output buffer
-int read_word(const char *input, char *output) {
+// and append them to an output buffer (expanding $ expansions if an env is
+// given; words split off by a command substitution, or by a variable if
+// splitVars is set, go to tokens)
+int read_word(const char *input, wordbuf_t *output, env_t *env, strarr_t *tokens, int splitVars) {
   int i = 0;
   // Copy the characters one at a time, as long as the character is non-special
   // and we haven't reached the end of the input
-  while (!is_special(input[i]) && input[i] != '\0' && input[i] != '"') {
-    // overwrite buffer
-    output[i] = input[i];
-    ++i;
+  while (!is_special(input[i]) && input[i] != '\0' && input[i] != '\n' && input[i] != '"') {
+    if (input[i] == '$') {
+      i += expand_dollar(&input[i], output, env, tokens, splitVars);
+    }
+    else {
+      wordbuf_append(output, &input[i], 1);
+      ++i;
+    }
   }
-  // Return the length of the word
+  // Return the number of characters read
   return i; 
 }
 
 // Read a sequence of characters bounded by double quotes from an input string,
-// and write them to an output buffer (without the double quotes)
-int read_sentence(const char *input, char *output) {
+// and append them to an output buffer (without the double quotes, and expanding
+// $ expansions if an env is given)
+int read_sentence(const char *input, wordbuf_t *output, env_t *env) {
   int i = 0;
   // Copy the characters one at a time, as long as the character isn't a
   // double quote and we haven't reached the end of the input
   while (input[i] != '"' && input[i] != '\0' && input[i] != '\n') {
-    // overwrite buffer
-    output[i] = input[i];
-    ++i;
+    if (input[i] == '$') {
+      i += expand_dollar(&input[i], output, env, NULL, 0);
+    }
+    else {
+      wordbuf_append(output, &input[i], 1);
+      ++i;
+    }
   }
-  // Return the length of the sentence
+  // Return the number of characters read
   return i;
 }
 
-// Takes a string and decomposes it into an array of string tokens.
-// char* -> strarr_t*
-strarr_t *tokenize(char expr[]) {
-  assert(strlen(expr) < MAX_EXPR_LEN);
+// Takes a string and decomposes it into an array of string tokens, expanding
+// $NAME, ${NAME}, $(( expression )) and $( command ) with the given variable
+// store and replacing unquoted words containing *, ? or [...] with the paths
+// they match. If env is NULL, the string is tokenized literally. If raw is
+// set (and env is NULL), words are kept exactly as they were written, quotes
+// and all, so they can be expanded later with tokenize_expand. Unquoted
+// substitutions are split into words at whitespace, and so are unquoted
+// variables if splitVars is set.
+// char*, env_t*, int, int -> strarr_t*
+strarr_t *tokenize_words(char expr[], env_t *env, int raw, int splitVars) {
+  // Buffer for the token being assembled; once the token is complete, the
+  // buffer itself goes into the token array
+  wordbuf_t word = { NULL, 0, 0 };
 
-  // Temporary string buffer; we use this buffer to store words before allocating
-  // memory for the word in the token array; no word is longer than 255 chars
-  char temp_buffer[MAX_EXPR_LEN];
-
-  // Allocate memory for the token array. We assume there can be
-  // at most 255 unique tokens (each character in the expr string).
-  strarr_t *tokens = strarr_new(MAX_EXPR_LEN);
+  // The token array starts out empty and grows as tokens are added, so a
+  // short command only allocates a short array
+  strarr_t *tokens = strarr_new(0);
 
   int i = 0;
 
@@ -79,52 +355,123 @@ strarr_t *tokenize(char expr[]) {
     if (is_special(expr[i])) {
       // SUB-CASE 1: not whitespace
       if (!is_whitespace(expr[i])) {
-        char *special = (char *)malloc(2 * sizeof(char));
-        special[0] = expr[i];
-        special[1] = '\0';
-        tokens->data[tokens->size] = special;
-        ++tokens->size;
-        ++i;
+        // "<<" (here-document), "<<<" (here-string) and ">>" (append) are
+        // single tokens
+        int len = 1;
+        while (expr[i] == '<' && expr[i + len] == '<' && len < 3) {
+          ++len;
+        }
+        if (expr[i] == '>' && expr[i + 1] == '>') {
+          len = 2;
+        }
+        char *special = (char *)malloc((len + 1) * sizeof(char));
+        memcpy(special, &expr[i], len);
+        special[len] = '\0';
+        strarr_take(tokens, special);
+        i += len;
       }
       // SUB-CASE 1: whitespace
       else {
         ++i;
       }
     } 
-    // CASE 2: sentence
-    else if (expr[i] == '"') {
-      // Read and write to a temporary buffer (and increment by 1 to skip
-      // over the first double quote)
-      int len = read_sentence(&expr[++i], temp_buffer);
-      
-      // Only add to tokens if sentence is not empty 
-      if (len) {
-        // Allocate some memory for the sentence based on the length plus the null terminator
-        char *sentence = (char *)malloc((len + 1) * sizeof(char));
-        for (int j = 0; j < len; j++) {
-          sentence[j] = temp_buffer[j]; // copy over chars to word
+    // CASE 2: word, made up of plain runs and sentences (bounded by double
+    // quotes) with nothing separating them, e.g. NAME="some value"
+    else {
+      word.len = 0;
+      int quoted = 0;
+      int start = i;
+      // an unquoted $( ) (or $NAME, in a list) can split the word into
+      // several, which are added to tokens from here on
+      unsigned int firstWord = tokens->size;
+      while (!is_special(expr[i]) && expr[i] != '\n' && expr[i] != '\0') {
+        if (expr[i] == '"') {
+          quoted = 1;
+          // skip over the opening double quote, then the sentence, then the
+          // closing double quote (if there is one)
+          i += 1 + read_sentence(&expr[i + 1], &word, env);
+          if (expr[i] == '"') {
+            i++;
+          }
         }
-        sentence[len] = '\0';
-        tokens->data[tokens->size] = sentence;
-        ++tokens->size;
+        else {
+          i += read_word(&expr[i], &word, env, tokens, splitVars);
+        }
+      }
+
+      // A lone 2 right before a '>' makes it a redirection of stderr: "2>",
+      // "2>>" and "2>&1" are single tokens
+      if (!quoted && word.len == 1 && word.data[0] == '2' && expr[i] == '>') {
+        int len = 1;
+        if (expr[i + 1] == '>') {
+          len = 2;
+        }
+        else if (expr[i + 1] == '&' && expr[i + 2] == '1') {
+          len = 3;
+        }
+        wordbuf_append(&word, &expr[i], len);
         i += len;
+        flush_word(&word, tokens);
+        continue;
       }
-      i++;
-    }
-    // CASE 3: word
-    else {
-      // Read and write to a temporary buffer
-      int len = read_word(&expr[i], temp_buffer);
-      // Allocate some memory for the word based on the length plus the null terminator
-      char *word = (char *)malloc((len + 1) * sizeof(char));
-      for (int j = 0; j < len; j++) {
-        word[j] = temp_buffer[j]; // copy over chars to word
+
+      if (raw) {
+        strarr_take(tokens, strndup(&expr[start], i - start));
+        continue;
+      }
+
+      // Unquoted patterns are replaced by the paths they match, including
+      // every word a substitution split off
+      int glob = env != NULL && !quoted;
+      if (glob && tokens->size > firstWord) {
+        unsigned int count = tokens->size - firstWord;
+        char **split = (char **)malloc(count * sizeof(char *));
+        assert(split != NULL);
+        memcpy(split, &tokens->data[firstWord], count * sizeof(char *));
+        tokens->size = firstWord;
+        for (unsigned int j = 0; j < count; j++) {
+          add_word(tokens, split[j], glob);
+        }
+        free(split);
+      }
+      // Only add to tokens if the word is not empty
+      if (word.len) {
+        add_word(tokens, word.data, glob);
+        word.data = NULL;
+        word.len = 0;
+        word.cap = 0;
       }
-      word[len] = '\0';
-      tokens->data[tokens->size] = word;
-      ++tokens->size;
-      i += len; 
     }
   }
+
+  free(word.data);
   return tokens;
-}
\ No newline at end of file
+}
+
+// Takes a string and decomposes it into an array of string tokens, expanding
+// it with the given variable store (if env is not NULL).
+// char*, env_t* -> strarr_t*
+strarr_t *tokenize_expand(char expr[], env_t *env) {
+  return tokenize_words(expr, env, 0, 0);
+}
+
+// Takes a string and decomposes it into a list of words, expanding it with
+// the given variable store and splitting unquoted variables into words too
+// (for the words a for loop goes over).
+// char*, env_t* -> strarr_t*
+strarr_t *tokenize_list(char expr[], env_t *env) {
+  return tokenize_words(expr, env, 0, 1);
+}
+
+// Takes a string and decomposes it into an array of tokens without
+// expanding anything; words keep their quotes.
+// char* -> strarr_t*
+strarr_t *tokenize_raw(char expr[]) {
+  return tokenize_words(expr, NULL, 1, 0);
+}
+
+// Takes a string and decomposes it into an array of string tokens.
+// char* -> strarr_t*
+strarr_t *tokenize(char expr[]) {
+  return tokenize_expand(expr, NULL);
+}
@@ -0,0 +1,111 @@
+/**
+ * Framed protocol used by the shell's server mode (see proto.h).
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "proto.h"
+
+// Read exactly len bytes. Returns 0 on success, or -1 on error or if the
+// stream ended first.
+static int read_full(int fd, void *buf, size_t len) {
+  char *p = (char *) buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/** Send a frame over the given socket. */
+int frame_write(int fd, char type, const void *data, uint32_t len) {
+  unsigned char header[FRAME_HEADER_LEN];
+  header[0] = type;
+  header[1] = len >> 24;
+  header[2] = len >> 16;
+  header[3] = len >> 8;
+  header[4] = len;
+
+  // header and payload go out together in a single call when possible
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = FRAME_HEADER_LEN;
+  iov[1].iov_base = (void *) data;
+  iov[1].iov_len = len;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  while (msg.msg_iovlen > 0) {
+    // MSG_NOSIGNAL: a vanished client is an error, not a SIGPIPE
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      return -1;
+    }
+    // skip over whatever was sent
+    while (msg.msg_iovlen > 0 && (size_t) n >= msg.msg_iov[0].iov_len) {
+      n -= msg.msg_iov[0].iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov[0].iov_base = (char *) msg.msg_iov[0].iov_base + n;
+      msg.msg_iov[0].iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/** Send a FRAME_EXIT frame carrying the given status. */
+int frame_write_status(int fd, int status) {
+  unsigned char payload[4];
+  payload[0] = (uint32_t) status >> 24;
+  payload[1] = (uint32_t) status >> 16;
+  payload[2] = (uint32_t) status >> 8;
+  payload[3] = (uint32_t) status;
+  return frame_write(fd, FRAME_EXIT, payload, sizeof(payload));
+}
+
+/** Receive a frame from the given socket. */
+int frame_read(int fd, char **data, uint32_t *len) {
+  unsigned char header[FRAME_HEADER_LEN];
+  if (read_full(fd, header, FRAME_HEADER_LEN) == -1) {
+    return -1;
+  }
+
+  uint32_t n = ((uint32_t) header[1] << 24) | ((uint32_t) header[2] << 16)
+               | ((uint32_t) header[3] << 8) | header[4];
+  if (n > FRAME_MAX_LEN) {
+    return -1;
+  }
+
+  char *payload = (char *) malloc(n + 1);
+  if (payload == NULL) {
+    return -1;
+  }
+  if (read_full(fd, payload, n) == -1) {
+    free(payload);
+    return -1;
+  }
+  payload[n] = '\0';
+
+  *data = payload;
+  *len = n;
+  return header[0];
+}
@@ -0,0 +1,44 @@
+#ifndef _PROTO_H
+#define _PROTO_H
+
+#include <stdint.h>
+
+/*
+ * Framed protocol spoken over the socket of `shell --serve PATH`.
+ *
+ * Every frame is a one byte type, a four byte payload length (big endian)
+ * and the payload. A client sends FRAME_LINE frames; for each one the server
+ * streams back any number of FRAME_STDOUT and FRAME_STDERR frames followed by
+ * a single FRAME_EXIT frame, after which the next line may be sent. Closing
+ * the connection ends the session.
+ */
+
+/* client -> server: a command line to execute (no trailing newline) */
+#define FRAME_LINE 'L'
+/* server -> client: a chunk of the command's standard output */
+#define FRAME_STDOUT 'O'
+/* server -> client: a chunk of the command's standard error */
+#define FRAME_STDERR 'E'
+/* server -> client: the line finished; the payload is its exit status as
+ * a four byte big endian integer */
+#define FRAME_EXIT 'X'
+
+/* Size of the type and length that precede each payload. */
+#define FRAME_HEADER_LEN 5
+
+/* Frames with a longer payload are rejected. */
+#define FRAME_MAX_LEN (16 * 1024 * 1024)
+
+/** Send a frame over the given socket. Returns 0 on success, or -1 on error
+ *  (including the peer having gone away). */
+int frame_write(int fd, char type, const void *data, uint32_t len);
+
+/** Send a FRAME_EXIT frame carrying the given status. */
+int frame_write_status(int fd, int status);
+
+/** Receive a frame from the given socket. On success returns the frame's type
+ *  and sets *data to a null terminated copy of the payload (which the caller
+ *  must free) and *len to its length. Returns -1 on end of file or error. */
+int frame_read(int fd, char **data, uint32_t *len);
+
+#endif /* ifndef _PROTO_H */
@@ -0,0 +1,193 @@
+/**
+ * Session recordings.
+ *
+ * A recording is the magic string, a version byte and the wall clock start
+ * time, followed by one entry per line. Every number is stored as an
+ * unsigned LEB128 varint, and entry start times are stored as the delta from
+ * the previous entry (zigzag encoded, since a nested line is written before
+ * the earlier starting line that ran it), so a typical entry costs a handful
+ * of bytes on top of the line itself:
+ *
+ *   start delta (us) | duration (us) | exit status | depth | line length | line
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "record.h"
+
+/** Main data structure for a recording. */
+struct recording {
+  FILE *file;
+  uint64_t epoch_us;       /* Wall clock start time of the recording. */
+  uint64_t last_start_us;  /* Start time of the previous entry. */
+  char *line;              /* Buffer for lines read back (reading only). */
+  unsigned int line_cap;
+};
+
+// Write an unsigned varint
+static int put_varint(FILE *f, uint64_t value) {
+  do {
+    unsigned char byte = value & 0x7f;
+    value >>= 7;
+    if (value != 0) {
+      byte |= 0x80;
+    }
+    if (putc(byte, f) == EOF) {
+      return -1;
+    }
+  } while (value != 0);
+  return 0;
+}
+
+// Read an unsigned varint. Returns 1 on success, 0 on a clean end of file
+// (before the first byte) and -1 if the varint is cut short or too long.
+static int get_varint(FILE *f, uint64_t *value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = getc(f);
+    if (c == EOF) {
+      return shift == 0 ? 0 : -1;
+    }
+    *value |= (uint64_t) (c & 0x7f) << shift;
+    if ((c & 0x80) == 0) {
+      return 1;
+    }
+  }
+  return -1;
+}
+
+// Allocate a recording around an open file
+static recording_t *recording_new(FILE *file) {
+  recording_t *rec = (recording_t *) malloc(sizeof(recording_t));
+  if (rec == NULL) {
+    fclose(file);
+    return NULL;
+  }
+  rec->file = file;
+  rec->epoch_us = 0;
+  rec->last_start_us = 0;
+  rec->line = NULL;
+  rec->line_cap = 0;
+  return rec;
+}
+
+/** Create a new recording at the given path. */
+recording_t *recording_create(const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    return NULL;
+  }
+  recording_t *rec = recording_new(file);
+  if (rec == NULL) {
+    return NULL;
+  }
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  rec->epoch_us = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+
+  fputs(RECORDING_MAGIC, file);
+  putc(RECORDING_VERSION, file);
+  put_varint(file, rec->epoch_us);
+  if (fflush(file) == EOF) {
+    recording_close(rec);
+    return NULL;
+  }
+  return rec;
+}
+
+/** Open an existing recording for reading. */
+recording_t *recording_open(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  recording_t *rec = recording_new(file);
+  if (rec == NULL) {
+    return NULL;
+  }
+
+  char magic[sizeof(RECORDING_MAGIC)];
+  size_t magic_len = strlen(RECORDING_MAGIC);
+  if (fread(magic, 1, magic_len, file) != magic_len
+      || memcmp(magic, RECORDING_MAGIC, magic_len) != 0
+      || getc(file) != RECORDING_VERSION
+      || get_varint(file, &rec->epoch_us) != 1) {
+    recording_close(rec);
+    return NULL;
+  }
+  return rec;
+}
+
+/** Wall clock time the recording started at. */
+uint64_t recording_epoch_us(recording_t *rec) {
+  return rec->epoch_us;
+}
+
+/** Append an entry to a recording. */
+int recording_append(recording_t *rec, const record_entry_t *entry) {
+  int64_t delta = (int64_t) (entry->start_us - rec->last_start_us);
+  rec->last_start_us = entry->start_us;
+
+  if (put_varint(rec->file, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63)) == -1
+      || put_varint(rec->file, entry->duration_us) == -1
+      || put_varint(rec->file, (uint64_t) entry->status) == -1
+      || put_varint(rec->file, entry->depth) == -1
+      || put_varint(rec->file, entry->len) == -1
+      || fwrite(entry->line, 1, entry->len, rec->file) != entry->len) {
+    return -1;
+  }
+  // flush each entry so that a crash loses at most the line that caused it
+  return fflush(rec->file) == EOF ? -1 : 0;
+}
+
+/** Read the next entry of a recording. */
+int recording_next(recording_t *rec, record_entry_t *entry) {
+  uint64_t delta, duration, status, depth, len;
+  int result = get_varint(rec->file, &delta);
+  if (result != 1) {
+    return result;
+  }
+  // undo the zigzag encoding
+  delta = (delta >> 1) ^ -(delta & 1);
+  if (get_varint(rec->file, &duration) != 1
+      || get_varint(rec->file, &status) != 1
+      || get_varint(rec->file, &depth) != 1
+      || get_varint(rec->file, &len) != 1
+      || len > 0xffffffu) {
+    return -1;
+  }
+
+  if (len + 1 > rec->line_cap) {
+    rec->line_cap = len + 1;
+    rec->line = (char *) realloc(rec->line, rec->line_cap);
+    if (rec->line == NULL) {
+      return -1;
+    }
+  }
+  if (fread(rec->line, 1, len, rec->file) != len) {
+    return -1;
+  }
+  rec->line[len] = '\0';
+
+  rec->last_start_us += delta;
+  entry->start_us = rec->last_start_us;
+  entry->duration_us = duration;
+  entry->status = (int) status;
+  entry->depth = (unsigned int) depth;
+  entry->line = rec->line;
+  entry->len = len;
+  return 1;
+}
+
+/** Close the recording. */
+void recording_close(recording_t *rec) {
+  if (rec == NULL) {
+    return;
+  }
+  fclose(rec->file);
+  free(rec->line);
+  free(rec);
+}
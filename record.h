@@ -0,0 +1,50 @@
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include <stdint.h>
+
+/** Type of an open session recording (fields are hidden). */
+typedef struct recording recording_t;
+
+/** A single recorded line. */
+typedef struct record_entry {
+  uint64_t start_us;       /* When the line started, relative to the recording's start. */
+  uint64_t duration_us;    /* How long the line took to run. */
+  int status;              /* Exit status of the line's last command. */
+  unsigned int depth;      /* 0 for a line of input, 1 and up for a line run
+                              by source from the line it's nested in. */
+  char *line;              /* The line itself (null terminated), followed by
+                              the input its here-documents read, if any. */
+  unsigned int len;        /* Length of the line. */
+} record_entry_t;
+
+/** Create a new recording at the given path (replacing any existing file).
+ *  Returns NULL on error. */
+recording_t *recording_create(const char *path);
+
+/** Open an existing recording for reading. Returns NULL on error, or if the
+ *  file is not a recording. */
+recording_t *recording_open(const char *path);
+
+/** Wall clock time (microseconds since the epoch) the recording started at. */
+uint64_t recording_epoch_us(recording_t *rec);
+
+/** Append an entry to a recording opened with recording_create. Entries are
+ *  appended as their lines finish, so a nested line comes before the line
+ *  that ran it. Returns 0 on success, or -1 on error. */
+int recording_append(recording_t *rec, const record_entry_t *entry);
+
+/** Read the next entry of a recording opened with recording_open. The line
+ *  is owned by the recording and only valid until the next call. Returns 1 if
+ *  an entry was read, 0 at the end of the recording, or -1 if it is corrupt. */
+int recording_next(recording_t *rec, record_entry_t *entry);
+
+/** Close the recording, freeing all memory it occupies. */
+void recording_close(recording_t *rec);
+
+
+/* Identifies a recording file; followed by a version byte. */
+#define RECORDING_MAGIC "SHREC"
+#define RECORDING_VERSION 1
+
+#endif /* ifndef _RECORD_H */
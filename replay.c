@@ -0,0 +1,361 @@
+/**
+ * Replays a session recorded with `shell --record FILE` against a shell
+ * binary and reports throughput and latency percentiles.
+ *
+ * The shell is started in server mode and every copy of the session is
+ * replayed over a connection of its own, so each line's latency is measured
+ * from sending it to receiving its exit status.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "proto.h"
+#include "record.h"
+#include "stats.h"
+
+// ============================== HELPERS ==============================
+
+// A recorded line we're going to replay
+typedef struct replay_line {
+  uint64_t start_us;
+  uint64_t duration_us;
+  int status;
+  char *line;
+  unsigned int len;
+} replay_line_t;
+
+// What a worker reports back once it's done
+typedef struct worker_result {
+  unsigned long count;       // number of latencies that follow
+  unsigned long mismatches;  // lines whose exit status differed from the recording
+} worker_result_t;
+
+// microseconds elapsed on a monotonic clock
+uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// print usage information
+void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-s shell] [-x] [-c copies] recording\n", prog);
+  fprintf(stderr, "  -s shell   shell binary to replay against (default ./shell)\n");
+  fprintf(stderr, "  -x         replay as fast as possible instead of at the original pace\n");
+  fprintf(stderr, "  -c copies  number of copies of the session to replay concurrently\n");
+}
+
+// load every line of the recording at the given path
+// returns the number of lines, or -1 on error
+long load_recording(const char *path, replay_line_t **lines) {
+  recording_t *rec = recording_open(path);
+  if (rec == NULL) {
+    fprintf(stderr, "%s: not a recording\n", path);
+    return -1;
+  }
+
+  long count = 0;
+  long capacity = 64;
+  *lines = (replay_line_t *)malloc(capacity * sizeof(replay_line_t));
+
+  record_entry_t entry;
+  int result;
+  while ((result = recording_next(rec, &entry)) == 1) {
+    // the lines a sourced file ran are run again by replaying the line
+    // that sourced it
+    if (entry.depth > 0) {
+      continue;
+    }
+    if (count == capacity) {
+      capacity *= 2;
+      *lines = (replay_line_t *)realloc(*lines, capacity * sizeof(replay_line_t));
+    }
+    replay_line_t *l = &(*lines)[count++];
+    l->start_us = entry.start_us;
+    l->duration_us = entry.duration_us;
+    l->status = entry.status;
+    l->line = strdup(entry.line);
+    l->len = entry.len;
+  }
+  recording_close(rec);
+
+  if (result == -1) {
+    fprintf(stderr, "%s: recording is corrupt\n", path);
+    return -1;
+  }
+  return count;
+}
+
+// connect to the server at the given socket path
+// returns the connected socket, or -1 on error
+int connect_to(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    return -1;
+  }
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// print a line of latency statistics (in milliseconds)
+void print_stats(const char *label, const stats_t *st) {
+  printf("%-10s mean %.3f  stddev %.3f  min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+         label, st->mean, st->stddev, st->min, st->p50, st->p90, st->p99, st->max);
+}
+
+// =============================== WORKER ==============================
+
+// replay every line over a connection of our own and send the latencies
+// (in milliseconds) back through fd
+void run_worker(const char *path, replay_line_t *lines, long count, int paced, int fd) {
+  worker_result_t result = { 0, 0 };
+  double *latencies = (double *)malloc((count + 1) * sizeof(double));
+
+  int sock = connect_to(path);
+  if (sock == -1) {
+    perror("connect");
+  }
+
+  uint64_t started = now_us();
+  for (long i = 0; sock != -1 && i < count; i++) {
+    if (paced) {
+      // keep the recorded spacing between lines (ignoring the idle time
+      // before the first one)
+      uint64_t due = started + (lines[i].start_us - lines[0].start_us);
+      uint64_t now = now_us();
+      if (due > now) {
+        usleep(due - now);
+      }
+    }
+
+    uint64_t sent = now_us();
+    if (frame_write(sock, FRAME_LINE, lines[i].line, lines[i].len) == -1) {
+      break;
+    }
+
+    // discard the output until the line's exit status arrives
+    char *data;
+    uint32_t len;
+    int type;
+    while ((type = frame_read(sock, &data, &len)) != -1 && type != FRAME_EXIT) {
+      free(data);
+    }
+    if (type == -1) {
+      // the session ended (e.g. the recording ran "exit")
+      break;
+    }
+
+    int status = ((unsigned char)data[0] << 24) | ((unsigned char)data[1] << 16)
+                 | ((unsigned char)data[2] << 8) | (unsigned char)data[3];
+    free(data);
+
+    latencies[result.count++] = (now_us() - sent) / 1000.0;
+    if (status != lines[i].status) {
+      result.mismatches++;
+    }
+  }
+
+  if (sock != -1) {
+    close(sock);
+  }
+  if (write(fd, &result, sizeof(result)) != sizeof(result)
+      || write(fd, latencies, result.count * sizeof(double)) != (ssize_t)(result.count * sizeof(double))) {
+    perror("write");
+    exit(1);
+  }
+  exit(0);
+}
+
+// read exactly len bytes from fd
+// returns 0 on success, -1 on error
+int read_full(int fd, void *buf, size_t len) {
+  char *p = (char *)buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// =============================== MAIN ===============================
+
+int main(int argc, char **argv) {
+  const char *shell = "./shell";
+  int paced = 1;
+  long copies = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:xc:")) != -1) {
+    switch (opt) {
+      case 's':
+        shell = optarg;
+        break;
+      case 'x':
+        paced = 0;
+        break;
+      case 'c':
+        copies = strtol(optarg, NULL, 10);
+        if (copies < 1) {
+          usage(argv[0]);
+          return 2;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  replay_line_t *lines;
+  long count = load_recording(argv[optind], &lines);
+  if (count == -1) {
+    return 1;
+  }
+  if (count == 0) {
+    printf("Nothing to replay.\n");
+    return 0;
+  }
+
+  // start the shell in server mode on a socket in a private directory
+  char dir[] = "/tmp/replay.XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  char path[sizeof(dir) + 8];
+  snprintf(path, sizeof(path), "%s/sock", dir);
+
+  pid_t server = fork();
+  if (server == -1) {
+    perror("fork");
+    return 1;
+  }
+  else if (server == 0) {
+    int devnull = open("/dev/null", O_RDWR);
+    dup2(devnull, STDIN_FILENO);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    execl(shell, shell, "--serve", path, (char *)NULL);
+    perror(shell);
+    exit(127);
+  }
+
+  // wait (up to 5 seconds) for the server to start listening
+  int probe = -1;
+  for (int i = 0; i < 500 && probe == -1; i++) {
+    probe = connect_to(path);
+    if (probe == -1) {
+      usleep(10000);
+    }
+  }
+  if (probe == -1) {
+    fprintf(stderr, "%s: server didn't start\n", shell);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    rmdir(dir);
+    return 1;
+  }
+  close(probe);
+
+  // launch the copies
+  int fds[copies];
+  pid_t workers[copies];
+  uint64_t started = now_us();
+  for (long i = 0; i < copies; i++) {
+    int pipefds[2];
+    if (pipe(pipefds) == -1) {
+      perror("pipe");
+      exit(1);
+    }
+    workers[i] = fork();
+    if (workers[i] == -1) {
+      perror("fork");
+      exit(1);
+    }
+    else if (workers[i] == 0) {
+      close(pipefds[0]);
+      run_worker(path, lines, count, paced, pipefds[1]);
+    }
+    close(pipefds[1]);
+    fds[i] = pipefds[0];
+  }
+
+  // collect their latencies
+  double *latencies = (double *)malloc(copies * count * sizeof(double) + 1);
+  unsigned long total = 0;
+  unsigned long mismatches = 0;
+  for (long i = 0; i < copies; i++) {
+    worker_result_t result;
+    if (read_full(fds[i], &result, sizeof(result)) == -1
+        || result.count > (unsigned long)count
+        || read_full(fds[i], &latencies[total], result.count * sizeof(double)) == -1) {
+      fprintf(stderr, "copy %ld failed\n", i + 1);
+    }
+    else {
+      total += result.count;
+      mismatches += result.mismatches;
+    }
+    close(fds[i]);
+    waitpid(workers[i], NULL, 0);
+  }
+  double elapsed = (now_us() - started) / 1000000.0;
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  unlink(path);
+  rmdir(dir);
+
+  // what the recorded session itself took, for comparison
+  double *recorded = (double *)malloc(count * sizeof(double));
+  for (long i = 0; i < count; i++) {
+    recorded[i] = lines[i].duration_us / 1000.0;
+  }
+
+  stats_t replayed_stats, recorded_stats;
+  stats_compute(latencies, total, &replayed_stats);
+  stats_compute(recorded, count, &recorded_stats);
+
+  printf("Replayed %lu of %ld lines (%ld cop%s, %s) in %.3f s: %.1f lines/s\n",
+         total, count * copies, copies, copies == 1 ? "y" : "ies",
+         paced ? "original pace" : "maximum rate", elapsed, total / elapsed);
+  printf("Latency (ms)\n");
+  print_stats("replayed", &replayed_stats);
+  print_stats("recorded", &recorded_stats);
+  printf("Exit status mismatches: %lu\n", mismatches);
+
+  for (long i = 0; i < count; i++) {
+    free(lines[i].line);
+  }
+  free(lines);
+  free(latencies);
+  free(recorded);
+  return 0;
+}
@@ -0,0 +1,373 @@
+// Parser for command lines with control flow (if, while and for). A line is
+// lexed once into raw words (see tokenize_raw) and parsed into a tree of
+// nodes; only the words that contain an expansion are expanded again each
+// time their command runs. The shell executes the tree (see run_node).
+//
+// Include after parse.h.
+
+// ============================== NODES ================================
+
+typedef enum node_type {
+  NODE_COMMAND,   // a simple command (or pipeline)
+  NODE_LIST,      // commands run one after the other
+  NODE_IF,        // if cond; then body; [elif ...;] [else orelse;] fi
+  NODE_WHILE,     // while cond; do body; done
+  NODE_FOR        // for var in words; do body; done
+} node_type_t;
+
+typedef struct node {
+  node_type_t type;
+
+  // NODE_COMMAND: the command's words as they were written; NODE_FOR: the
+  // words to loop over. expand[i] says whether words->data[i] has to be
+  // expanded before it's used (plain words are just copied).
+  strarr_t *words;
+  unsigned char *expand;
+
+  // NODE_COMMAND: the here-document body each command of its pipeline reads
+  // (data[0] for the first one, NULL for one without; the array is NULL if
+  // there are none). They're read along with the line and kept for as long
+  // as the node, so every run sees them.
+  strarr_t *heredocs;
+
+  // NODE_LIST: the commands in the list
+  struct node **items;
+  unsigned int count;
+
+  // NODE_IF and NODE_WHILE: the condition; all but NODE_COMMAND: the body;
+  // NODE_IF: the else (or elif) branch, if there is one
+  struct node *cond;
+  struct node *body;
+  struct node *orelse;
+
+  // NODE_FOR: the loop variable
+  char *var;
+} node_t;
+
+// Results of parsing a line
+#define PARSE_OK 0
+#define PARSE_INCOMPLETE 1   // a compound command is still open
+#define PARSE_ERROR 2
+
+// Parser state: the raw tokens of the line and the next one to look at
+typedef struct parser {
+  strarr_t *tokens;
+  unsigned int next;
+  int result;              // PARSE_OK until something goes wrong
+  const char *near;        // the token a syntax error was found at
+} parser_t;
+
+// Allocate a node of the given type with nothing in it
+node_t *node_new(node_type_t type) {
+  node_t *node = (node_t *)calloc(1, sizeof(node_t));
+  assert(node != NULL);
+  node->type = type;
+  return node;
+}
+
+// Free a node and everything under it
+void node_delete(node_t *node) {
+  if (node == NULL) {
+    return;
+  }
+  strarr_delete(node->words);
+  free(node->expand);
+  strarr_delete(node->heredocs);
+  for (unsigned int i = 0; i < node->count; i++) {
+    node_delete(node->items[i]);
+  }
+  free(node->items);
+  node_delete(node->cond);
+  node_delete(node->body);
+  node_delete(node->orelse);
+  free(node->var);
+  free(node);
+}
+
+// Does a raw word have to be expanded before it's used?
+int word_needs_expansion(const char *word) {
+  return strpbrk(word, "$\"*?[") != NULL;
+}
+
+// Is the raw word at index i of words a here-document operator with a
+// delimiter after it? (A quoted "<<" keeps its quotes in the raw words.)
+int word_is_heredoc(strarr_t *words, unsigned int i) {
+  return i + 1 < words->size && strcmp(words->data[i], "<<") == 0;
+}
+
+// Expand the raw words of a node into the tokens to run (or loop over).
+// A command's here-documents are left out, since the node holds them. The
+// words a for loop goes over are split at whitespace in variables too.
+strarr_t *node_expand(node_t *node, env_t *env) {
+  strarr_t *tokens = strarr_new(node->words->size);
+  for (unsigned int i = 0; i < node->words->size; i++) {
+    if (node->type == NODE_COMMAND && word_is_heredoc(node->words, i)) {
+      i++;
+    }
+    else if (node->expand[i] && node->type == NODE_FOR) {
+      strarr_adopt(tokens, tokenize_list(node->words->data[i], env));
+    }
+    else if (node->expand[i]) {
+      strarr_adopt(tokens, tokenize_expand(node->words->data[i], env));
+    }
+    else {
+      strarr_add(tokens, node->words->data[i]);
+    }
+  }
+  return tokens;
+}
+
+// ============================== PARSER ===============================
+
+// Is the next token the given (unquoted) word?
+int parser_at(parser_t *p, const char *word) {
+  return p->next < p->tokens->size && strcmp(p->tokens->data[p->next], word) == 0;
+}
+
+// Is the next token one of the NULL terminated list of words?
+int parser_at_any(parser_t *p, const char **words) {
+  for (unsigned int i = 0; words[i] != NULL; i++) {
+    if (parser_at(p, words[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Note a syntax error at the next token (or the end of the line, which
+// means the line isn't finished yet)
+void parser_fail(parser_t *p) {
+  if (p->result != PARSE_OK) {
+    return;
+  }
+  if (p->next < p->tokens->size) {
+    p->result = PARSE_ERROR;
+    p->near = p->tokens->data[p->next];
+  }
+  else {
+    p->result = PARSE_INCOMPLETE;
+  }
+}
+
+// Consume the given word, or fail if it isn't next
+void parser_expect(parser_t *p, const char *word) {
+  if (parser_at(p, word)) {
+    p->next++;
+  }
+  else {
+    parser_fail(p);
+  }
+}
+
+// Move the words from the next token up to the next ";" (or the end) into
+// a node's words
+void parser_take_words(parser_t *p, node_t *node) {
+  unsigned int start = p->next;
+  while (p->next < p->tokens->size && !parser_at(p, ";")) {
+    p->next++;
+  }
+
+  node->words = strarr_new(p->next - start);
+  node->expand = (unsigned char *)malloc(p->next - start + 1);
+  assert(node->expand != NULL);
+  for (unsigned int i = start; i < p->next; i++) {
+    node->expand[i - start] = word_needs_expansion(p->tokens->data[i]);
+    strarr_take(node->words, p->tokens->data[i]);
+    p->tokens->data[i] = NULL;
+  }
+}
+
+node_t *parse_list(parser_t *p, const char **terminators);
+
+// Parse "if" (or "elif") up to and including the "fi" that ends it
+node_t *parse_if(parser_t *p) {
+  static const char *THEN[] = { "then", NULL };
+  static const char *ELSE[] = { "elif", "else", "fi", NULL };
+  static const char *FI[] = { "fi", NULL };
+
+  node_t *node = node_new(NODE_IF);
+  p->next++;
+  node->cond = parse_list(p, THEN);
+  parser_expect(p, "then");
+  node->body = parse_list(p, ELSE);
+  if (parser_at(p, "elif")) {
+    // the elif takes care of the fi
+    node->orelse = parse_if(p);
+    return node;
+  }
+  if (parser_at(p, "else")) {
+    p->next++;
+    node->orelse = parse_list(p, FI);
+  }
+  parser_expect(p, "fi");
+  return node;
+}
+
+// Parse "while cond; do body; done"
+node_t *parse_while(parser_t *p) {
+  static const char *DO[] = { "do", NULL };
+  static const char *DONE[] = { "done", NULL };
+
+  node_t *node = node_new(NODE_WHILE);
+  p->next++;
+  node->cond = parse_list(p, DO);
+  parser_expect(p, "do");
+  node->body = parse_list(p, DONE);
+  parser_expect(p, "done");
+  return node;
+}
+
+// Parse "for var in words; do body; done"
+node_t *parse_for(parser_t *p) {
+  static const char *DONE[] = { "done", NULL };
+
+  node_t *node = node_new(NODE_FOR);
+  p->next++;
+  if (p->next < p->tokens->size && env_valid_name(p->tokens->data[p->next])) {
+    node->var = strdup(p->tokens->data[p->next++]);
+  }
+  else {
+    parser_fail(p);
+    return node;
+  }
+  parser_expect(p, "in");
+  if (p->result != PARSE_OK) {
+    return node;
+  }
+  parser_take_words(p, node);
+
+  while (parser_at(p, ";")) {
+    p->next++;
+  }
+  parser_expect(p, "do");
+  node->body = parse_list(p, DONE);
+  parser_expect(p, "done");
+  return node;
+}
+
+// Parse a list of commands separated by ";", up to (but not including) one
+// of the NULL terminated list of terminators, or the end of the line if
+// terminators is NULL
+node_t *parse_list(parser_t *p, const char **terminators) {
+  static const char *KEYWORDS[] = { "then", "elif", "else", "fi", "do", "done", NULL };
+
+  node_t *list = node_new(NODE_LIST);
+  unsigned int capacity = 0;
+
+  while (p->result == PARSE_OK) {
+    while (parser_at(p, ";")) {
+      p->next++;
+    }
+    if (p->next == p->tokens->size) {
+      // the end of the line only ends the outermost list
+      if (terminators != NULL) {
+        parser_fail(p);
+      }
+      break;
+    }
+    if (terminators != NULL && parser_at_any(p, terminators)) {
+      // an empty condition or body isn't allowed
+      if (list->count == 0) {
+        parser_fail(p);
+      }
+      break;
+    }
+    if (parser_at_any(p, KEYWORDS)) {
+      parser_fail(p);
+      break;
+    }
+
+    node_t *command;
+    if (parser_at(p, "if")) {
+      command = parse_if(p);
+    }
+    else if (parser_at(p, "while")) {
+      command = parse_while(p);
+    }
+    else if (parser_at(p, "for")) {
+      command = parse_for(p);
+    }
+    else {
+      command = node_new(NODE_COMMAND);
+      parser_take_words(p, command);
+    }
+
+    if (list->count == capacity) {
+      capacity = capacity ? capacity * 2 : 4;
+      list->items = (node_t **)realloc(list->items, capacity * sizeof(node_t *));
+      assert(list->items != NULL);
+    }
+    list->items[list->count++] = command;
+
+    // a compound command has to be followed by a ";" (or the end)
+    if (p->result == PARSE_OK && command->type != NODE_COMMAND
+        && p->next < p->tokens->size && !parser_at(p, ";")
+        && !(terminators != NULL && parser_at_any(p, terminators))) {
+      parser_fail(p);
+    }
+  }
+  return list;
+}
+
+// Parse a line into a tree of nodes, setting *script to it. Returns
+// PARSE_OK, PARSE_INCOMPLETE if the line ends in the middle of a compound
+// command, or PARSE_ERROR (setting *near to a copy of the token the error
+// was found at, which the caller frees) if it isn't valid.
+int parse_script(char line[], node_t **script, char **near) {
+  parser_t p = { tokenize_raw(line), 0, PARSE_OK, NULL };
+  *script = parse_list(&p, NULL);
+  *near = p.near != NULL ? strdup(p.near) : NULL;
+  strarr_delete(p.tokens);
+
+  if (p.result != PARSE_OK) {
+    node_delete(*script);
+    *script = NULL;
+  }
+  return p.result;
+}
+
+// Hand the here-document bodies (in the order they were read) out to the
+// commands under node whose "<<" operators they belong to, in the order the
+// commands appear, each to the command of its pipeline that reads it (the
+// last one wins if a command has several). An operator left without a body
+// (when there was nothing to read it from) gets an empty one. *next is the
+// index of the next body to hand out; the commands take the bodies over.
+void script_attach_heredocs(node_t *node, strarr_t *bodies, unsigned int *next) {
+  if (node == NULL) {
+    return;
+  }
+  if (node->type == NODE_COMMAND) {
+    unsigned int stage = 0;
+    for (unsigned int i = 0; i < node->words->size; i++) {
+      if (strcmp(node->words->data[i], "|") == 0) {
+        stage++;
+      }
+      if (!word_is_heredoc(node->words, i)) {
+        continue;
+      }
+      char *body;
+      if (*next < bodies->size) {
+        body = bodies->data[*next];
+        bodies->data[(*next)++] = NULL;
+      }
+      else {
+        body = strdup("");
+      }
+      if (node->heredocs == NULL) {
+        node->heredocs = strarr_new(0);
+      }
+      while (node->heredocs->size <= stage) {
+        strarr_take(node->heredocs, NULL);
+      }
+      free(node->heredocs->data[stage]);
+      node->heredocs->data[stage] = body;
+    }
+    return;
+  }
+  for (unsigned int i = 0; i < node->count; i++) {
+    script_attach_heredocs(node->items[i], bodies, next);
+  }
+  script_attach_heredocs(node->cond, bodies, next);
+  script_attach_heredocs(node->body, bodies, next);
+  script_attach_heredocs(node->orelse, bodies, next);
+}
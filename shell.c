@@ -4,44 +4,187 @@
 #include <assert.h>
 #include <ctype.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 
 #include "parse.h" 
+#include "script.h"
+#include "proto.h"
+#include "record.h"
+#include "stats.h"
+#include "lineedit.h"
+#include "complete.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+
+#include "alloc.h"
 
 // ============================= CONSTANTS =============================
 
 const int MAX_EXP_LEN = 255;
 
+// size of the chunks server mode forwards a command's output in
+#define RELAY_BUF_LEN (64 * 1024)
+
+// initial size of the buffer command substitution captures output in (it
+// doubles as needed)
+#define CAPTURE_BUF_LEN (64 * 1024)
+
+// most bytes fanned out to several > targets at a time
+#define FANOUT_CHUNK (1024 * 1024)
+
+// most runs (and warmup runs) bench does of a command
+#define BENCH_MAX_RUNS 1000000
+
+// permissions of the files > and >> create
+#define OUTPUT_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH)
+
+
+// ============================== GLOBALS ==============================
+
+// shell variables; the exported ones make up the environment of the
+// programs we launch
+env_t *shell_env;
+
+// exit status of the last command (available as $?)
+int last_status = 0;
+
+// CPU time used by the children we've waited for so far (bench measures it
+// per run)
+struct timeval child_utime = { 0, 0 };
+struct timeval child_stime = { 0, 0 };
+
+// line editor for standard input when it's a terminal (NULL otherwise)
+lineedit_t *line_editor = NULL;
+
+// session recording (NULL if we're not recording), and the time its
+// timestamps are relative to
+recording_t *recording = NULL;
+uint64_t recording_started = 0;
+
+// how many lines the line running now is nested in (by source)
+unsigned int line_depth = 0;
+
+// set in the child running a $( ... ) substitution, whose output is
+// captured (so exit doesn't say goodbye into it)
+int in_substitution = 0;
+
+// built-in commands, for tab completion
+const char *BUILTINS[] = {
+  "cd", "source", "export", "unset", "bench", "alloc-stats", "prev", "help", "exit",
+  "if", "while", "for", NULL
+};
+
 
 // ============================= PROTOTYPES ============================
 
-int execute(strarr_t *tokens);
+int execute(strarr_t *tokens, strarr_t *heredocs);
+int execute_line(char *line, FILE *input);
+int parse_line(char **line, FILE *input, const char *prompt, node_t **script, char **near);
+int run_line(char *line, int result, node_t *script, char *near);
+uint64_t now_us();
+ssize_t read_line(char **buffer, size_t *bufferCap, FILE *input, const char *prompt);
 
 
 // ============================== HELPERS ==============================
 
 // Changes the directory 
 void cd_command(strarr_t *tokens) {
+  const char *dir;
   if (tokens->size == 1) {
     // no arguments, change to home directory
-    if (chdir(getenv("HOME")) == -1) {
-      perror("cd");
+    dir = env_get(shell_env, "HOME");
+    if (dir == NULL) {
+      printf("cd: HOME not set\n");
+      last_status = 1;
+      return;
     }
   }
   else if (tokens->size == 2) {
     // one argument, change to specified directory
-    if (chdir(tokens->data[1]) == -1) {
-      perror("cd");
-    }
+    dir = tokens->data[1];
   }
   else {
     // too many arguments
     printf("cd: too many arguments\n");
+    last_status = 1;
+    return;
+  }
+
+  if (chdir(dir) == -1) {
+    perror("cd");
+    last_status = 1;
+    return;
+  }
+
+  // keep PWD up to date for the programs we launch
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) != NULL) {
+    env_set(shell_env, "PWD", cwd);
+  }
+}
+
+// Is the given token a variable assignment (NAME=value)?
+int is_assignment(const char *token) {
+  unsigned int len = env_name_len(token);
+  return len > 0 && token[len] == '=';
+}
+
+// Assign a shell variable from a NAME=value token
+void assign_variable(char *token) {
+  unsigned int len = env_name_len(token);
+  // temporarily split the token at the '=' to get the name on its own
+  token[len] = '\0';
+  env_set(shell_env, token, &token[len + 1]);
+  token[len] = '=';
+}
+
+// Export shell variables ("export NAME=value" or "export NAME") so that
+// launched programs see them. With no arguments, list the exported variables.
+void export_command(strarr_t *tokens) {
+  if (tokens->size == 1) {
+    char **envp = env_envp(shell_env);
+    for (int i = 0; envp[i] != NULL; i++) {
+      printf("export %s\n", envp[i]);
+    }
+    return;
+  }
+
+  for (int i = 1; i < tokens->size; i++) {
+    char *arg = tokens->data[i];
+    if (is_assignment(arg)) {
+      assign_variable(arg);
+      arg[env_name_len(arg)] = '\0';
+      env_export(shell_env, arg);
+      arg[env_name_len(arg)] = '=';
+    }
+    else if (env_valid_name(arg)) {
+      // exporting an unset variable is a no-op
+      env_export(shell_env, arg);
+    }
+    else {
+      printf("export: not a valid identifier: %s\n", arg);
+      last_status = 1;
+    }
+  }
+}
+
+// Remove shell variables
+void unset_command(strarr_t *tokens) {
+  for (int i = 1; i < tokens->size; i++) {
+    // unsetting a variable that isn't set is not an error
+    env_unset(shell_env, tokens->data[i]);
   }
 }
 
@@ -51,132 +194,775 @@ int source_command(strarr_t *tokens) {
   // check that there is exactly one argument
   if (tokens->size != 2) {
     printf("Usage: source <filename>\n");
-    return 0;
+    last_status = 2;
+    return 1;
   }
 
   // open the file for reading
   FILE *file = fopen(tokens->data[1], "r");
   if (file == NULL) {
     perror("fopen");
-    return 0;
+    last_status = 1;
+    return 1;
   }
 
   int exitStatus = 1;
 
-  // read and execute each line of the file
-  char line[MAX_EXP_LEN + 1];
-  while (exitStatus == 1 && fgets(line, sizeof(line), file) != NULL) {
+  // read and execute each line of the file (lines can be as long as they
+  // like now that token arrays grow)
+  char *buffer = NULL;
+  size_t bufferCap = 0;
+  while (exitStatus == 1 && getline(&buffer, &bufferCap, file) != -1) {
     // remove trailing newline (if any)
-    char *nl = strchr(line, '\n');
+    char *nl = strchr(buffer, '\n');
     if (nl != NULL) {
       *nl = '\0';
     }
 
-    // tokenize and execute the line as a command
-    strarr_t *line_tokens = tokenize(line);
-    exitStatus = execute(line_tokens);
-    strarr_delete(line_tokens);
+    // the line may grow to take in the lines of a compound command that
+    // it starts, so it gets a buffer of its own
+    char *line = buffer;
+    buffer = NULL;
+    bufferCap = 0;
+
+    // execute the line as a (sequence of) command(s)
+    node_t *script;
+    char *near;
+    int result = parse_line(&line, file, NULL, &script, &near);
+    exitStatus = run_line(line, result, script, near);
+    node_delete(script);
+    free(line);
   }
 
   // close the file
+  free(buffer);
   fclose(file);
   return exitStatus;
 }
 
+// show where the shell's memory goes (in builds with the allocation
+// profiler; see alloc.h)
+void alloc_stats_command(strarr_t *tokens) {
+  int reset = tokens->size == 2 && strcmp(tokens->data[1], "-r") == 0;
+  if (tokens->size > 2 || (tokens->size == 2 && !reset)) {
+    printf("Usage: alloc-stats [-r]\n");
+    last_status = 2;
+    return;
+  }
+#ifdef ALLOC_PROFILE
+  alloc_report(stdout);
+  if (reset) {
+    alloc_reset();
+  }
+#else
+  printf("alloc-stats: not available (rebuild with make ALLOC_PROFILE=1)\n");
+  last_status = 1;
+#endif
+}
+
+// print a string as a JSON string literal
+void print_json_string(const char *str) {
+  putchar('"');
+  for (const char *c = str; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      printf("\\%c", *c);
+    }
+    else if ((unsigned char)*c < 0x20) {
+      printf("\\u%04x", *c);
+    }
+    else {
+      putchar(*c);
+    }
+  }
+  putchar('"');
+}
+
+// print a row of bench statistics (in milliseconds)
+void print_bench_stats(const char *label, const stats_t *st) {
+  printf("%-6s %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", label,
+         st->mean, st->stddev, st->min, st->p50, st->p90, st->p99, st->max);
+}
+
+// print bench statistics (in milliseconds) as a JSON object
+void print_bench_json(const stats_t *st) {
+  printf("{\"mean\":%.3f,\"stddev\":%.3f,\"min\":%.3f,\"p50\":%.3f,"
+         "\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+         st->mean, st->stddev, st->min, st->p50, st->p90, st->p99, st->max);
+}
+
+// milliseconds in a timeval
+double timeval_ms(const struct timeval *tv) {
+  return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+// run a command repeatedly through execute and report how long the runs
+// took (wall clock, and the CPU time of the programs they ran). heredocs
+// are the bodies of the command's here-documents, which every run gets.
+// returns 0 to exit. returns 1 to continue.
+int bench_command(strarr_t *tokens, strarr_t *heredocs) {
+  long runs = 10;
+  long warmup = 1;
+  int json = 0;
+
+  // the options come before the command (which may have options of its own)
+  unsigned int first = 1;
+  while (first < tokens->size && tokens->data[first][0] == '-') {
+    const char *opt = tokens->data[first];
+    if (strcmp(opt, "-j") == 0) {
+      json = 1;
+      first++;
+      continue;
+    }
+    if ((strcmp(opt, "-n") != 0 && strcmp(opt, "-w") != 0) || first + 1 == tokens->size) {
+      first = tokens->size;
+      break;
+    }
+    char *end;
+    long value = strtol(tokens->data[first + 1], &end, 10);
+    if (*end != '\0' || end == tokens->data[first + 1] || value < (opt[1] == 'n' ? 1 : 0)
+        || value > BENCH_MAX_RUNS) {
+      first = tokens->size;
+      break;
+    }
+    if (opt[1] == 'n') {
+      runs = value;
+    }
+    else {
+      warmup = value;
+    }
+    first += 2;
+  }
+  if (first >= tokens->size) {
+    printf("Usage: bench [-n runs] [-w warmup] [-j] command\n");
+    last_status = 2;
+    return 1;
+  }
+
+  double *wall = (double *)malloc(runs * sizeof(double));
+  double *user = (double *)malloc(runs * sizeof(double));
+  double *sys = (double *)malloc(runs * sizeof(double));
+  if (wall == NULL || user == NULL || sys == NULL) {
+    printf("bench: not enough memory for %ld runs\n", runs);
+    free(wall);
+    free(user);
+    free(sys);
+    last_status = 1;
+    return 1;
+  }
+  long measured = 0;
+  int exitStatus = 1;
+
+  for (long run = 0; run < warmup + runs && exitStatus == 1; run++) {
+    // execute consumes the tokens it's given, so every run gets a copy
+    strarr_t *command = strarr_new(tokens->size - first);
+    for (unsigned int j = first; j < tokens->size; j++) {
+      strarr_add(command, tokens->data[j]);
+    }
+
+    struct timeval utime = child_utime;
+    struct timeval stime = child_stime;
+    uint64_t started = now_us();
+    exitStatus = execute(command, heredocs);
+    uint64_t elapsed = now_us() - started;
+
+    if (run >= warmup) {
+      struct timeval used;
+      wall[measured] = elapsed / 1000.0;
+      timersub(&child_utime, &utime, &used);
+      user[measured] = timeval_ms(&used);
+      timersub(&child_stime, &stime, &used);
+      sys[measured] = timeval_ms(&used);
+      measured++;
+    }
+
+    strarr_delete(command);
+  }
+
+  if (measured > 0) {
+    stats_t wallStats, userStats, sysStats;
+    stats_compute(wall, measured, &wallStats);
+    stats_compute(user, measured, &userStats);
+    stats_compute(sys, measured, &sysStats);
+
+    // the command, as one string (leaving out here-document bodies, which
+    // show as "<< ..." at the end of the command that reads them)
+    wordbuf_t command = { NULL, 0, 0 };
+    unsigned int stage = 0;
+    for (unsigned int j = first; j <= tokens->size; j++) {
+      int stageEnd = j == tokens->size || strcmp(tokens->data[j], "|") == 0;
+      if (stageEnd && heredocs != NULL && stage < heredocs->size
+          && heredocs->data[stage] != NULL) {
+        wordbuf_append(&command, " << ...", 7);
+      }
+      if (j == tokens->size) {
+        break;
+      }
+      stage += stageEnd;
+      const char *token = tokens->data[j];
+      wordbuf_append(&command, " ", j > first);
+      wordbuf_append(&command, token, strlen(token));
+    }
+
+    if (json) {
+      printf("{\"command\":");
+      print_json_string(command.data);
+      printf(",\"runs\":%ld,\"warmup\":%ld,\"status\":%d,\"wall_ms\":", measured, warmup, last_status);
+      print_bench_json(&wallStats);
+      printf(",\"user_ms\":");
+      print_bench_json(&userStats);
+      printf(",\"sys_ms\":");
+      print_bench_json(&sysStats);
+      printf("}\n");
+    }
+    else {
+      printf("%ld run%s of %s (after %ld warmup), times in ms:\n",
+             measured, measured == 1 ? "" : "s", command.data, warmup);
+      printf("%-6s %10s %10s %10s %10s %10s %10s %10s\n",
+             "", "mean", "stddev", "min", "p50", "p90", "p99", "max");
+      print_bench_stats("wall", &wallStats);
+      print_bench_stats("user", &userStats);
+      print_bench_stats("sys", &sysStats);
+    }
+    free(command.data);
+  }
+
+  free(wall);
+  free(user);
+  free(sys);
+  return exitStatus;
+}
+
 // print out built-in commands 
 void help_command() {
   printf("\n*** Shell Built-in Commands ***\n\n");
   printf("  cd [directory]  Change the current working directory.\n");
   printf("  source [file]   Execute commands from a file in the current shell.\n");
+  printf("  export [name[=value] ...]\n");
+  printf("                  Pass variables on to launched programs.\n");
+  printf("  unset [name ...]\n");
+  printf("                  Remove variables.\n");
+  printf("  bench [-n runs] [-w warmup] [-j] command\n");
+  printf("                  Run a command repeatedly (at most %d times) and\n", BENCH_MAX_RUNS);
+  printf("                  report its timings.\n");
+  printf("  alloc-stats [-r]\n");
+  printf("                  Show allocation statistics (and reset them with -r).\n");
   printf("  prev            Execute the previous command.\n");
   printf("  help            Display this help message.\n");
   printf("  exit            Terminate the shell.\n\n");
+  printf("*** Input and output ***\n\n");
+  printf("  cmd <<DELIM     Feed the lines that follow, up to DELIM, to cmd.\n");
+  printf("  cmd <<< word    Feed word (and a newline) to cmd.\n");
+  printf("  cmd > file      Write the output of cmd to file (>> appends to it).\n");
+  printf("  cmd > a > b     Write the output of cmd to both a and b (and to the\n");
+  printf("                  next command, if cmd is part of a pipeline).\n");
+  printf("  cmd 2> file     Write the errors of cmd to file (2>> appends to it).\n");
+  printf("  cmd 2>&1        Send the errors of cmd wherever its output goes.\n\n");
+  printf("*** Control flow ***\n\n");
+  printf("  if cmds; then cmds; [elif cmds; then cmds;] [else cmds;] fi\n");
+  printf("  while cmds; do cmds; done\n");
+  printf("  for name in words; do cmds; done\n");
+  printf("                  A compound command can span several lines.\n\n");
+  printf("*** Editing ***\n\n");
+  printf("  Up/Down         Go through the commands entered so far.\n");
+  printf("  Tab             Complete a command or file name (twice to list the\n");
+  printf("                  possibilities).\n");
+  printf("  Ctrl-A/Ctrl-E   Move to the start/end of the line.\n");
+  printf("  Ctrl-U/Ctrl-K/Ctrl-W\n");
+  printf("                  Delete to the start/end of the line, or a word.\n\n");
 }
 
 
 // ============================== EXECUTE ==============================
 
-// handle a system call command
-int execute_program(strarr_t *tokens) {
-  if (tokens->size == 0) {
-    return 1;
+// write all len bytes of buf to fd
+// returns 0 on success, -1 on error
+int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
   }
+  return 0;
+}
 
-  int exitStatus = 1;
+// Get a descriptor the given text can be read from. The text goes into an
+// anonymous in-memory file, so it never touches the filesystem. Where those
+// aren't available it's fed through a pipe instead, by a writer process if
+// it doesn't fit in the pipe's buffer. *writer (if writer isn't NULL) is set
+// to that process, for the caller to wait for, or -1 if there isn't one.
+// returns the descriptor, or -1 on error
+int text_fd(const char *text, size_t len, pid_t *writer) {
+  if (writer != NULL) {
+    *writer = -1;
+  }
+  int fd = memfd_create("heredoc", MFD_CLOEXEC);
+  if (fd != -1) {
+    if (write_all(fd, text, len) == -1 || lseek(fd, 0, SEEK_SET) == -1) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
 
-  // ========= PROGRAM =========
-  pid_t pid = fork();
-  if (pid == -1) {
-    perror("fork");
-    exit(1);
+  int pipefds[2];
+  if (pipe2(pipefds, O_CLOEXEC) == -1) {
+    return -1;
   }
-  else if (pid == 0) {
-    // child process 
+  int capacity = fcntl(pipefds[1], F_GETPIPE_SZ);
+  if (capacity != -1 && len <= (size_t)capacity) {
+    // fits in the pipe, so no one has to wait for the reader
+    write_all(pipefds[1], text, len);
+  }
+  else {
+    pid_t pid = fork();
+    if (pid == -1) {
+      close(pipefds[0]);
+      close(pipefds[1]);
+      return -1;
+    }
+    else if (pid == 0) {
+      close(pipefds[0]);
+      write_all(pipefds[1], text, len);
+      _exit(0);
+    }
+    if (writer != NULL) {
+      *writer = pid;
+    }
+  }
+  close(pipefds[1]);
+  return pipefds[0];
+}
 
-    // check if > symbol exists in the arguments
-    int fd;
-    int index = strarr_index_of(tokens, ">");
-    if (index != -1 && index < tokens->size - 1) {
-      // open file for writing and truncate if it already exists
-      fd = open(tokens->data[index + 1], O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
-      if (fd == -1) {
-          perror("open");
-          exit(1);
-      }
+// remove count tokens starting at index
+void remove_tokens(strarr_t *tokens, unsigned int index, unsigned int count) {
+  for (unsigned int k = index; k < index + count; k++) {
+    free(tokens->data[k]);
+  }
+  memmove(&tokens->data[index], &tokens->data[index + count],
+          (tokens->size - index - count) * sizeof(char *));
+  tokens->size -= count;
+}
 
-      // redirect stdout to file
-      if (dup2(fd, STDOUT_FILENO) == -1) {
-          perror("dup2");
-          exit(1);
+// Close the descriptors open_heredocs opened and wait for their writers
+void close_heredocs(int *fds, pid_t *writers, unsigned int count) {
+  for (unsigned int i = 0; i < count; i++) {
+    if (fds[i] != -1) {
+      close(fds[i]);
+    }
+    // (a writer whose reader is gone gets SIGPIPE)
+    if (writers[i] != -1) {
+      waitpid(writers[i], NULL, 0);
+    }
+  }
+}
+
+// Give the command of a pipeline that reads each of the here-documents in
+// heredocs (see node_t) a descriptor its body can be read from (-1 for one
+// without), and store the processes writing them, if any, in writers. The
+// body is written out once, and only the command that reads it (in a child
+// that inherits the descriptor) ever sees it.
+// returns the number of descriptors, or -1 on error (with none left open)
+int open_heredocs(strarr_t *heredocs, int *fds, pid_t *writers) {
+  if (heredocs == NULL) {
+    return 0;
+  }
+  for (unsigned int i = 0; i < heredocs->size; i++) {
+    fds[i] = -1;
+    writers[i] = -1;
+    const char *body = heredocs->data[i];
+    if (body != NULL && (fds[i] = text_fd(body, strlen(body), &writers[i])) == -1) {
+      perror("here-document");
+      close_heredocs(fds, writers, i);
+      return -1;
+    }
+  }
+  return heredocs->size;
+}
+
+// Feed here-strings (<<< word) to stdin and remove them from tokens
+void redirect_heredocs(strarr_t *tokens) {
+  unsigned int i = 0;
+  while (i + 1 < tokens->size) {
+    if (strcmp(tokens->data[i], "<<<") != 0) {
+      i++;
+      continue;
+    }
+
+    // a here-string gets a trailing newline
+    const char *text = tokens->data[i + 1];
+    size_t len = strlen(text);
+    char *line = (char *)malloc(len + 2);
+    memcpy(line, text, len);
+    line[len] = '\n';
+    int fd = text_fd(line, len + 1, NULL);
+    free(line);
+
+    if (fd == -1 || dup2(fd, STDIN_FILENO) == -1) {
+      perror("here-document");
+      _exit(1);
+    }
+    close(fd);
+    remove_tokens(tokens, i, 2);
+  }
+}
+
+// Replace the current process with the given program, looking it up in the
+// PATH shell variable (execvp would search our own, possibly stale, PATH).
+// Only returns if the program couldn't be launched.
+void exec_program(char **args, char **envp) {
+  if (strchr(args[0], '/') != NULL) {
+    execve(args[0], args, envp);
+    return;
+  }
+
+  const char *path = env_get(shell_env, "PATH");
+  if (path == NULL) {
+    path = "/usr/local/bin:/usr/bin:/bin";
+  }
+
+  char candidate[PATH_MAX];
+  size_t name_len = strlen(args[0]);
+  const char *dir = path;
+  while (1) {
+    const char *end = strchrnul(dir, ':');
+    size_t dir_len = end - dir;
+    if (dir_len + name_len + 2 <= sizeof(candidate)) {
+      // an empty PATH entry means the current directory
+      if (dir_len == 0) {
+        candidate[dir_len++] = '.';
       }
+      else {
+        memcpy(candidate, dir, dir_len);
+      }
+      candidate[dir_len] = '/';
+      memcpy(&candidate[dir_len + 1], args[0], name_len + 1);
+      execve(candidate, args, envp);
+    }
+    if (*end == '\0') {
+      break;
+    }
+    dir = end + 1;
+  }
+}
 
-      // remove arguments after > (including >)
-      int numDelete = tokens->size - index;
-      for (int k = 0; k < numDelete; k++) {
-        strarr_remove_last(tokens);
+// Wait for the given child to finish, adding the CPU time it used to
+// child_utime and child_stime
+// returns the child's pid, or -1 on error (like waitpid)
+pid_t wait_child(pid_t pid, int *status) {
+  struct rusage usage;
+  pid_t result = wait4(pid, status, 0, &usage);
+  if (result != -1) {
+    timeradd(&child_utime, &usage.ru_utime, &child_utime);
+    timeradd(&child_stime, &usage.ru_stime, &child_stime);
+  }
+  return result;
+}
+
+// Record the exit status of a finished child, as reported by waitpid
+void set_status(int status) {
+  if (WIFEXITED(status)) {
+    last_status = WEXITSTATUS(status);
+  }
+  else if (WIFSIGNALED(status)) {
+    last_status = 128 + WTERMSIG(status);
+  }
+}
+
+// Make the last exit status available as $?
+void update_status_variable() {
+  char status[16];
+  snprintf(status, sizeof(status), "%d", last_status);
+  env_set(shell_env, "?", status);
+}
+
+// Move n bytes from the pipe in to out. Moving them with splice keeps them
+// in the kernel; targets splice can't write to (e.g. a file opened for
+// appending) get them through a buffer instead. If out can't take them
+// (e.g. it's a pipe whose reader went away), they're discarded.
+// returns 0 if the bytes were written, -1 if they were discarded
+int move_bytes(int in, int out, size_t n) {
+  while (n > 0) {
+    ssize_t moved = splice(in, NULL, out, NULL, n, SPLICE_F_MOVE);
+    if (moved == -1 && errno == EINTR) {
+      continue;
+    }
+    if (moved == 0) {
+      // the end of the input: there's nothing left to move
+      return 0;
+    }
+    if (moved == -1) {
+      break;
+    }
+    n -= moved;
+  }
+  if (n == 0) {
+    return 0;
+  }
+
+  int ok = errno == EINVAL;
+  char buf[64 * 1024];
+  while (n > 0) {
+    ssize_t got = read(in, buf, n < sizeof(buf) ? n : sizeof(buf));
+    if (got == -1 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      break;
+    }
+    if (ok && write_all(out, buf, got) == -1) {
+      ok = 0;
+    }
+    n -= got;
+  }
+  return ok ? 0 : -1;
+}
+
+// Copy everything written to the pipe in to each of the given targets until
+// its write end is closed. tee duplicates the data into a pipe of each
+// target's own, from which it's spliced on, so it's never copied through
+// user space. The last target takes the data straight from in.
+void fan_out(int in, int *targets, int numTargets) {
+  int copies[numTargets][2];
+  int size = fcntl(in, F_GETPIPE_SZ);
+  for (int k = 0; k < numTargets - 1; k++) {
+    if (pipe(copies[k]) == -1) {
+      perror("pipe");
+      _exit(1);
+    }
+    // as big as in, so a tee into an empty copy always takes everything
+    fcntl(copies[k][1], F_SETPIPE_SZ, size);
+  }
+
+  while (1) {
+    // wait for data, and duplicate whatever arrived into every copy
+    ssize_t n = tee(in, copies[0][1], FANOUT_CHUNK, 0);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    for (int k = 1; k < numTargets - 1; k++) {
+      ssize_t copied;
+      while ((copied = tee(in, copies[k][1], n, 0)) == -1 && errno == EINTR) {}
+      if (copied != n) {
+        perror("tee");
+        _exit(1);
       }
     }
 
-    char **args = (char **)malloc(sizeof(char *) * (tokens->size + 1));
-    for (int i = 0; i < tokens->size; i++) {
-      args[i] = strarr_get_copy(tokens, i);
+    for (int k = 0; k < numTargets - 1; k++) {
+      move_bytes(copies[k][0], targets[k], n);
     }
-    args[tokens->size] = NULL;
+    move_bytes(in, targets[numTargets - 1], n);
+  }
+}
 
-    // launch program with exec
-    if (execvp(args[0], args) == -1) {
-      printf("%s: command not found\n", args[0]);
+// Set up the output redirections in tokens (> file, >> file, 2> file,
+// 2>> file and 2>&1, applied from left to right) and remove them from
+// tokens. If stdout goes to more than one place (several > targets, or a
+// target as well as the next command of a pipeline if piped is set), the
+// command runs in a child of its own while this process fans its output
+// out and exits with its status once it's done; only the child returns.
+void redirect_output(strarr_t *tokens, int piped) {
+  int targets[tokens->size + 1];
+  int numTargets = 0;
+
+  unsigned int i = 0;
+  while (i < tokens->size) {
+    const char *op = tokens->data[i];
+    int isOut = strcmp(op, ">") == 0 || strcmp(op, ">>") == 0;
+    int isErr = strcmp(op, "2>") == 0 || strcmp(op, "2>>") == 0;
+    if (strcmp(op, "2>&1") == 0) {
+      // stderr goes wherever stdout goes at this point: stdout as it is now
+      // before any >, and the last target after one (not the targets that
+      // come after it)
+      int out = numTargets > 0 ? targets[numTargets - 1] : STDOUT_FILENO;
+      if (dup2(out, STDERR_FILENO) == -1) {
+        perror("dup2");
+        _exit(1);
+      }
+      remove_tokens(tokens, i, 1);
+      continue;
+    }
+    if (!isOut && !isErr) {
+      i++;
+      continue;
+    }
 
-      // free memory for each string
-      for (int i = 0; i < tokens->size; i++) {
-          free(args[i]);
+    if (i + 1 == tokens->size) {
+      printf("%s: a file name must follow\n", op);
+      fflush(stdout);
+      _exit(2);
+    }
+    int append = strcmp(op, ">>") == 0 || strcmp(op, "2>>") == 0;
+    const char *file = tokens->data[i + 1];
+    int fd = open(file, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), OUTPUT_MODE);
+    if (fd == -1) {
+      perror(file);
+      _exit(1);
+    }
+    if (isOut) {
+      targets[numTargets++] = fd;
+    }
+    else {
+      if (dup2(fd, STDERR_FILENO) == -1) {
+        perror("dup2");
+        _exit(1);
       }
+      close(fd);
+    }
+    remove_tokens(tokens, i, 2);
+  }
 
-      // free args
-      free(args);
-      strarr_delete(tokens);
-      exit(1);
+  // the next command of the pipeline keeps getting the output too
+  if (piped && numTargets > 0) {
+    targets[numTargets++] = dup(STDOUT_FILENO);
+  }
+
+  if (numTargets == 1) {
+    if (dup2(targets[0], STDOUT_FILENO) == -1) {
+      perror("dup2");
+      _exit(1);
+    }
+    close(targets[0]);
+  }
+  else if (numTargets > 1) {
+    int pipefds[2];
+    if (pipe(pipefds) == -1) {
+      perror("pipe");
+      _exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+      perror("fork");
+      _exit(1);
+    }
+    else if (pid == 0) {
+      // the command writes into the pipe, and nothing else
+      for (int k = 0; k < numTargets; k++) {
+        close(targets[k]);
+      }
+      close(pipefds[0]);
+      if (dup2(pipefds[1], STDOUT_FILENO) == -1) {
+        perror("dup2");
+        _exit(1);
+      }
+      close(pipefds[1]);
     }
+    else {
+      // we hold the targets (and the pipeline's pipe) until the command and
+      // anything it started are done writing
+      close(pipefds[1]);
+      close(STDOUT_FILENO);
+      signal(SIGPIPE, SIG_IGN);
+      fan_out(pipefds[0], targets, numTargets);
+
+      int status;
+      if (waitpid(pid, &status, 0) == -1) {
+        _exit(1);
+      }
+      _exit(WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+    }
+  }
+}
+
+// Set up redirections and replace the current process with the program
+// described by tokens. If piped is set, stdout is a pipe to the next
+// command of a pipeline. If doc isn't -1, stdin is read from it (a
+// here-document; a here-string in tokens still takes its place). Meant to be called in a child process; never
+// returns. Like every child of the shell that doesn't exec, it leaves with
+// _exit, since exit would seek the stdin it shares with the shell back to
+// where its own copy of the buffer left off.
+void exec_command(strarr_t *tokens, char **envp, int piped, int doc) {
+  if (doc != -1 && dup2(doc, STDIN_FILENO) == -1) {
+    perror("here-document");
+    _exit(1);
+  }
+  redirect_heredocs(tokens);
+  redirect_output(tokens, piped);
+
+  // nothing left to run (e.g. just "> file", which creates the file)
+  if (tokens->size == 0) {
+    _exit(0);
+  }
+
+  // the token array itself becomes the argument vector once it's NULL
+  // terminated, so nothing needs to be copied
+  strarr_reserve(tokens, tokens->size + 1);
+  tokens->data[tokens->size] = NULL;
+
+  // launch program with exec (only returns on failure)
+  exec_program(tokens->data, envp);
+  if (errno == ENOENT) {
+    printf("%s: command not found\n", tokens->data[0]);
+  }
+  else {
+    printf("%s: %s\n", tokens->data[0], strerror(errno));
+  }
+  fflush(stdout);
+
+  strarr_delete(tokens);
+  _exit(127);
+}
+
+// handle a system call command (reading the here-document doc, unless it's
+// -1)
+int execute_program(strarr_t *tokens, int doc) {
+  if (tokens->size == 0) {
+    return 1;
+  }
+
+  int exitStatus = 1;
+
+  // get the environment before forking so the cached copy outlives the child
+  char **envp = env_envp(shell_env);
+
+  // flush anything a builtin printed so the child doesn't inherit it
+  fflush(stdout);
+
+  // ========= PROGRAM =========
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  else if (pid == 0) {
+    // child process 
+    exec_command(tokens, envp, 0, doc);
   }
   else {
     // parent process
-    wait(NULL);
+    int status;
+    if (wait_child(pid, &status) != -1) {
+      set_status(status);
+    }
   }
 
   return exitStatus;
 }
 
 
-// execute user input.
+// execute user input. heredocs holds the here-document body each command of
+// its pipeline reads (see node_t; it may be NULL if there are none).
 // returns 0 to prompt the program to exit.
 // returns 1 to prompt the program to continue.
-int execute(strarr_t *tokens) {
+int execute(strarr_t *tokens, strarr_t *heredocs) {
   if (tokens->size == 0) {
     return 1;
   }
 
   int exitStatus = 1;
 
+  // builtins succeed unless they say otherwise; programs report their own
+  last_status = 0;
+
   // ====== INPUT REDIRECTION ======
   for (int i = 0; i < tokens->size; i++) {
     // if we ever encounter "<", we should use the contents of the file
@@ -208,12 +994,8 @@ int execute(strarr_t *tokens) {
          return exitStatus;
        }
        buffer[length] = '\0';
-       strarr_t *args = tokenize(buffer);
-
-       for (int k = 0; k < args->size; k++) {
-         strarr_add(tokens, args->data[k]);
-       }
-       strarr_delete(args);
+       // move the file's tokens over to the command
+       strarr_adopt(tokens, tokenize(buffer));
 
        if (close(fd) == -1) {
          printf("Error trying to close %s\n", fileToken);
@@ -226,10 +1008,30 @@ int execute(strarr_t *tokens) {
 
   // ========= EXIT =========
   if (strcmp(tokens->data[0], "exit") == 0) {
-    printf("Bye bye.\n");
+    if (!in_substitution) {
+      printf("Bye bye.\n");
+    }
     return 0;
   }
   
+  // ========= ASSIGNMENT =========
+  else if (tokens->size == 1 && is_assignment(tokens->data[0])) {
+    assign_variable(tokens->data[0]);
+    return 1;
+  }
+
+  // ========= EXPORT =========
+  else if (strcmp(tokens->data[0], "export") == 0) {
+    export_command(tokens);
+    return 1;
+  }
+
+  // ========= UNSET =========
+  else if (strcmp(tokens->data[0], "unset") == 0) {
+    unset_command(tokens);
+    return 1;
+  }
+
   // ========= CD =========
   else if (strcmp(tokens->data[0], "cd") == 0) {
     cd_command(tokens);
@@ -241,6 +1043,17 @@ int execute(strarr_t *tokens) {
     return source_command(tokens);
   }
 
+  // ========= BENCH ==========
+  else if (strcmp(tokens->data[0], "bench") == 0) {
+    return bench_command(tokens, heredocs);
+  }
+
+  // ====== ALLOC-STATS =======
+  else if (strcmp(tokens->data[0], "alloc-stats") == 0) {
+    alloc_stats_command(tokens);
+    return 1;
+  }
+
   // ========= HELP =========
   else if (strcmp(tokens->data[0], "help") == 0) {
     help_command();
@@ -249,6 +1062,17 @@ int execute(strarr_t *tokens) {
 
   // ======== HANDLE PIPES ========
   else {
+    // here-documents are opened once for the whole command (the bodies
+    // stay with it for its next run)
+    unsigned int maxDocs = heredocs != NULL ? heredocs->size : 0;
+    int docFds[maxDocs + 1];
+    pid_t docWriters[maxDocs + 1];
+    int numDocs = open_heredocs(heredocs, docFds, docWriters);
+    if (numDocs == -1) {
+      last_status = 1;
+      return exitStatus;
+    }
+
     int numPipes = 0;
     for (int i = 0; i < tokens->size; i++) {
       if (strcmp(tokens->data[i], "|") == 0) {
@@ -267,9 +1091,20 @@ int execute(strarr_t *tokens) {
           exit(1);
         }
       }
-      
+
+      char **envp = env_envp(shell_env);
+      fflush(stdout);
+
       // launch child processes for each command
+      pid_t pids[numPipes + 1];
+      int start = 0;
       for (int i = 0; i <= numPipes; i++) {
+        // the current command runs up to the next "|" (or the end)
+        int end = start;
+        while (end < tokens->size && strcmp(tokens->data[end], "|") != 0) {
+          end++;
+        }
+
         pid_t pid = fork();
         if (pid == -1) {
           perror("fork");
@@ -278,36 +1113,28 @@ int execute(strarr_t *tokens) {
         else if (pid == 0) {
           // child process
           
-          // determine the arguments for the current command
-          int start = i;
-          strarr_t *command = strarr_new(tokens->capacity);
-          // create a subarray of tokens for the current command if this isn't
-          // the last command
-          if (i < numPipes) {
-            for (int j = i; j < tokens->size; j++) {
-              if (strcmp(tokens->data[j], "|") == 0) {
-                break;
-              }
-              else {
-                strarr_add(command, tokens->data[j]);
-              }
-            }
+          // create a subarray of tokens for the current command
+          // (this process has a copy of tokens of its own, so the strings
+          // can just be moved over)
+          strarr_t *command = strarr_new(end - start + 1);
+          for (int j = start; j < end; j++) {
+            strarr_take(command, tokens->data[j]);
+            tokens->data[j] = NULL;
           }
-          printf("COMMAND: %s\n", command->data[0]);
 
           // redirect input and output as necessary
           if (i > 0) {
             // redirect input to read end of previous pipe
             if (dup2(pipefds[(i - 1) * 2], STDIN_FILENO) < 0) {
               perror("dup2");
-              exit(1);
+              _exit(1);
             }
           }
           if (i < numPipes) {
             // redirect output to write end of current pipe
             if (dup2(pipefds[i * 2 + 1], STDOUT_FILENO) < 0) {
               perror("dup2");
-              exit(1);
+              _exit(1);
             }
           }
 
@@ -317,10 +1144,14 @@ int execute(strarr_t *tokens) {
           }
 
           // execute the command
-          exitStatus = execute_program(command);
-          strarr_delete(command);
-          exit(0);
+          if (command->size == 0) {
+            _exit(0);
+          }
+          exec_command(command, envp, i < numPipes, i < numDocs ? docFds[i] : -1);
         }
+
+        pids[i] = pid;
+        start = end + 1;
       }
 
       // close all pipe file descriptors in the parent process
@@ -328,34 +1159,658 @@ int execute(strarr_t *tokens) {
         close(pipefds[i]);
       }
 
-      // wait for all child processes to finish
+      // wait for all child processes to finish; the pipeline's status is
+      // that of its last command
       for (int i = 0; i <= numPipes; i++) {
-        wait(NULL);
+        int status;
+        if (wait_child(pids[i], &status) != -1 && i == numPipes) {
+          set_status(status);
+        }
       }
     }
     // no pipes, just execute the single command
     else {
-      exitStatus = execute_program(tokens);
+      exitStatus = execute_program(tokens, numDocs > 0 ? docFds[0] : -1);
+    }
+
+    close_heredocs(docFds, docWriters, numDocs);
+  }
+
+  return exitStatus;
+}
+
+// read the bodies of the here-documents (<<DELIM) in the given line from
+// input: the lines that follow, up to one consisting of just the delimiter.
+// Every line read, delimiters included, is also appended to raw.
+// returns the bodies in order
+strarr_t *read_heredocs(char *line, FILE *input, wordbuf_t *raw) {
+  strarr_t *bodies = strarr_new(0);
+  if (input == NULL || strstr(line, "<<") == NULL) {
+    return bodies;
+  }
+
+  // (the raw words tell an operator from a quoted "<<")
+  strarr_t *tokens = tokenize_raw(line);
+  char *bodyLine = NULL;
+  size_t bodyCap = 0;
+  for (unsigned int i = 0; i < tokens->size; i++) {
+    if (!word_is_heredoc(tokens, i)) {
+      continue;
+    }
+    // the delimiter itself can be quoted
+    strarr_t *delimWords = tokenize(tokens->data[i + 1]);
+    const char *delim = delimWords->size > 0 ? delimWords->data[0] : "";
+    size_t delimLen = strlen(delim);
+
+    // body lines can be as long as they like
+    wordbuf_t body = { NULL, 0, 0 };
+    wordbuf_append(&body, "", 0);
+    ssize_t n;
+    while ((n = getline(&bodyLine, &bodyCap, input)) != -1) {
+      size_t len = n;
+      if (len > 0 && bodyLine[len - 1] == '\n') {
+        len--;
+      }
+      wordbuf_append(raw, bodyLine, len);
+      wordbuf_append(raw, "\n", 1);
+      if (len == delimLen && memcmp(bodyLine, delim, len) == 0) {
+        break;
+      }
+      wordbuf_append(&body, bodyLine, len);
+      wordbuf_append(&body, "\n", 1);
+    }
+    strarr_take(bodies, body.data);
+    strarr_delete(delimWords);
+  }
+  free(bodyLine);
+  strarr_delete(tokens);
+  return bodies;
+}
+
+// run a parsed line (or part of one). Each command is expanded right before
+// it runs, so it sees variables set by the ones before it, and the commands
+// of a loop are expanded again on every iteration (but never parsed again).
+// returns 0 to prompt the program to exit.
+// returns 1 to prompt the program to continue.
+int run_node(node_t *node) {
+  int exitStatus = 1;
+  // status of the last command a loop ran (0 if it ran none)
+  int loopStatus = 0;
+
+  switch (node->type) {
+    case NODE_COMMAND: {
+      strarr_t *command = node_expand(node, shell_env);
+      exitStatus = execute(command, node->heredocs);
+      strarr_delete(command);
+
+      update_status_variable();
+      break;
+    }
+
+    case NODE_LIST:
+      // execute commands as long as the exit status is 1 (i.e., exiting in
+      // the middle of the sequence should stop the program)
+      for (unsigned int i = 0; exitStatus == 1 && i < node->count; i++) {
+        exitStatus = run_node(node->items[i]);
+      }
+      break;
+
+    case NODE_IF:
+      exitStatus = run_node(node->cond);
+      if (exitStatus == 1 && last_status == 0) {
+        exitStatus = run_node(node->body);
+      }
+      else if (exitStatus == 1 && node->orelse != NULL) {
+        exitStatus = run_node(node->orelse);
+      }
+      else if (exitStatus == 1) {
+        last_status = 0;
+        update_status_variable();
+      }
+      break;
+
+    case NODE_WHILE:
+      while (1) {
+        exitStatus = run_node(node->cond);
+        if (exitStatus != 1 || last_status != 0) {
+          break;
+        }
+        exitStatus = run_node(node->body);
+        loopStatus = last_status;
+        if (exitStatus != 1) {
+          break;
+        }
+      }
+      last_status = loopStatus;
+      update_status_variable();
+      break;
+
+    case NODE_FOR: {
+      strarr_t *values = node_expand(node, shell_env);
+      for (unsigned int i = 0; exitStatus == 1 && i < values->size; i++) {
+        env_set(shell_env, node->var, values->data[i]);
+        exitStatus = run_node(node->body);
+        loopStatus = last_status;
+      }
+      strarr_delete(values);
+
+      last_status = loopStatus;
+      update_status_variable();
+      break;
+    }
+  }
+  return exitStatus;
+}
+
+// complete the word before the cursor in a line being edited (a command,
+// from the built-ins and $PATH, or a file name)
+unsigned int complete_input(const char *line, unsigned int cursor, unsigned int *start,
+                            char ***matches) {
+  return complete_word(line, cursor, env_get(shell_env, "PATH"), BUILTINS, start, matches);
+}
+
+// read a line of input into *buffer (growing it as needed), first printing
+// prompt if it isn't NULL. Lines typed at a terminal go through the line
+// editor. Trailing whitespace (including the newline) is removed.
+// returns the length of the line, or -1 at the end of the input
+ssize_t read_line(char **buffer, size_t *bufferCap, FILE *input, const char *prompt) {
+  ssize_t length;
+  if (input == stdin && line_editor != NULL && prompt != NULL) {
+    // (the editor writes straight to the terminal)
+    fflush(stdout);
+    char *edited = lineedit_read(line_editor, prompt);
+    if (edited == NULL) {
+      return -1;
+    }
+    free(*buffer);
+    *buffer = edited;
+    length = strlen(edited);
+    *bufferCap = length + 1;
+  }
+  else {
+    if (prompt != NULL) {
+      printf("%s", prompt);
+      fflush(stdout);
+    }
+    length = getline(buffer, bufferCap, input);
+    if (length == -1) {
+      return -1;
+    }
+  }
+
+  while (length > 0 && isspace((*buffer)[length - 1])) {
+    (*buffer)[--length] = '\0';
+  }
+  return length;
+}
+
+// parse a line into *script. As long as it ends in the middle of a compound
+// command (and input isn't NULL), the lines that follow are read from input
+// and joined onto it with "; ", so *line (which must have been allocated
+// with malloc) may be replaced by a longer one. prompt, if it isn't NULL,
+// is printed before each of those lines. The bodies of the here-documents
+// in each line are read from input right after it, and go to the commands
+// they belong to. What they read is kept after a newline at the end of
+// *line (the way a --serve frame carries it), so the line can be recorded
+// and replayed as a whole; parsing stops at the first newline.
+// returns the result of parsing (see parse_script)
+int parse_line(char **line, FILE *input, const char *prompt, node_t **script, char **near) {
+  wordbuf_t docs = { NULL, 0, 0 };
+  strarr_t *bodies = read_heredocs(*line, input, &docs);
+  int result = parse_script(*line, script, near);
+
+  if (result == PARSE_INCOMPLETE && input != NULL) {
+    wordbuf_t joined = { *line, strlen(*line), strlen(*line) + 1 };
+    char *next = NULL;
+    size_t nextCap = 0;
+    while (result == PARSE_INCOMPLETE) {
+      ssize_t n = read_line(&next, &nextCap, input, prompt);
+      if (n == -1) {
+        break;
+      }
+      // the bodies come before the line after this one
+      strarr_adopt(bodies, read_heredocs(next, input, &docs));
+
+      wordbuf_append(&joined, "; ", 2);
+      wordbuf_append(&joined, next, n);
+      free(*near);
+      result = parse_script(joined.data, script, near);
+    }
+    free(next);
+    *line = joined.data;
+  }
+
+  if (result == PARSE_OK) {
+    unsigned int next = 0;
+    script_attach_heredocs(*script, bodies, &next);
+  }
+  strarr_delete(bodies);
+
+  if (docs.len > 0) {
+    wordbuf_t joined = { *line, strlen(*line), strlen(*line) + 1 };
+    wordbuf_append(&joined, "\n", 1);
+    wordbuf_append(&joined, docs.data, docs.len);
+    *line = joined.data;
+  }
+  free(docs.data);
+  return result;
+}
+
+// add a line that has just run to the recording (if there is one)
+void record_line(char *line, uint64_t started) {
+  if (recording == NULL) {
+    return;
+  }
+  record_entry_t entry;
+  entry.start_us = started - recording_started;
+  entry.duration_us = now_us() - started;
+  entry.status = last_status;
+  entry.depth = line_depth;
+  entry.line = line;
+  entry.len = strlen(line);
+  if (recording_append(recording, &entry) == -1) {
+    perror("record");
+  }
+}
+
+// run a line parsed by parse_line, and record it. The caller still owns
+// (and frees) the script, so it can be run again.
+// returns 0 to prompt the program to exit.
+// returns 1 to prompt the program to continue.
+int run_line(char *line, int result, node_t *script, char *near) {
+  int exitStatus = 1;
+  uint64_t started = now_us();
+
+  if (result == PARSE_ERROR) {
+    printf("syntax error near '%s'\n", near);
+  }
+  else if (result == PARSE_INCOMPLETE) {
+    printf("syntax error: unexpected end of input\n");
+  }
+  if (result != PARSE_OK) {
+    free(near);
+    last_status = 2;
+    update_status_variable();
+  }
+  else {
+    // (lines it sources are nested in it)
+    line_depth++;
+    exitStatus = run_node(script);
+    line_depth--;
+  }
+
+  record_line(line, started);
+  alloc_line_done();
+  return exitStatus;
+}
+
+// parse and execute a line, running the sequenced (;) commands in it in
+// order. The rest of a compound command it starts, and the bodies of any
+// here-documents in it, are read from input (which may be NULL).
+// returns 0 to prompt the program to exit.
+// returns 1 to prompt the program to continue.
+int execute_line(char *line, FILE *input) {
+  char *joined = strdup(line);
+  assert(joined != NULL);
+  node_t *script;
+  char *near;
+  int result = parse_line(&joined, input, NULL, &script, &near);
+  int exitStatus = run_line(joined, result, script, near);
+  node_delete(script);
+  free(joined);
+  return exitStatus;
+}
+
+// microseconds elapsed on a monotonic clock
+uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// run the command of a $( ... ) substitution in a child process and capture
+// everything it writes to stdout. Reads go straight into one growing buffer,
+// which is handed to the tokenizer as is.
+// returns the output (at least one byte longer than *outLen)
+char *run_command_substitution(const char *cmd, unsigned int len, unsigned int *outLen) {
+  int pipefds[2];
+  if (pipe2(pipefds, O_CLOEXEC) == -1) {
+    perror("pipe");
+    *outLen = 0;
+    return (char *)calloc(1, 1);
+  }
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  else if (pid == 0) {
+    // child process: run the command with stdout going into the pipe
+    // (its lines are part of the one that's recorded already)
+    recording = NULL;
+    in_substitution = 1;
+    close(pipefds[0]);
+    dup2(pipefds[1], STDOUT_FILENO);
+    close(pipefds[1]);
+
+    char line[len + 1];
+    memcpy(line, cmd, len);
+    line[len] = '\0';
+    execute_line(line, NULL);
+    // (_exit: exit would hand what stdin read ahead back to the shell by
+    // seeking its shared offset, and the shell would read it again)
+    fflush(stdout);
+    _exit(last_status);
+  }
+  close(pipefds[1]);
+
+  size_t cap = CAPTURE_BUF_LEN;
+  size_t size = 0;
+  char *out = (char *)malloc(cap);
+  while (1) {
+    if (cap - size < CAPTURE_BUF_LEN / 2) {
+      cap *= 2;
+      out = (char *)realloc(out, cap);
+      assert(out != NULL);
+    }
+    // leave room for a terminator
+    ssize_t n = read(pipefds[0], out + size, cap - size - 1);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    size += n;
+  }
+  close(pipefds[0]);
+
+  // the rest of the command sees the substitution's status in $?
+  int status;
+  if (wait_child(pid, &status) != -1) {
+    set_status(status);
+    update_status_variable();
+  }
+
+  *outLen = size;
+  return out;
+}
+
+// is the first word of the given line "prev"?
+int is_prev(const char *line) {
+  while (is_whitespace(*line)) {
+    line++;
+  }
+  return strncmp(line, "prev", 4) == 0 && (line[4] == '\0' || is_special(line[4]));
+}
+
+
+// =============================== SERVER ==============================
+
+// reap finished sessions so they don't linger as zombies
+void reap_sessions(int sig) {
+  int saved_errno = errno;
+  while (waitpid(-1, NULL, WNOHANG) > 0) {}
+  errno = saved_errno;
+}
+
+// forward everything written to the out and err pipes to the client as
+// frames, until both pipes are closed
+void relay_output(int client, int out, int err) {
+  struct pollfd fds[2] = { { out, POLLIN, 0 }, { err, POLLIN, 0 } };
+  char *buf = (char *)malloc(RELAY_BUF_LEN);
+  int numOpen = 2;
+
+  while (numOpen > 0) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      exit(1);
+    }
+
+    for (int i = 0; i < 2; i++) {
+      if (fds[i].revents == 0) {
+        continue;
+      }
+      ssize_t n = read(fds[i].fd, buf, RELAY_BUF_LEN);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        // closed; poll ignores negative descriptors
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        numOpen--;
+      }
+      else if (frame_write(client, i == 0 ? FRAME_STDOUT : FRAME_STDERR, buf, n) == -1) {
+        // the client is gone
+        exit(1);
+      }
     }
   }
 
+  free(buf);
+}
+
+// execute a line on behalf of a client, streaming its output back while it
+// runs, then send its exit status
+// returns 0 to end the session. returns 1 to continue.
+int serve_line(int client, char *line) {
+  int out[2], err[2];
+  if (pipe2(out, O_CLOEXEC) == -1 || pipe2(err, O_CLOEXEC) == -1) {
+    perror("pipe");
+    return 0;
+  }
+
+  // the line runs in this process (so cd, export etc. stick to the session);
+  // a helper process relays its output, so a chatty command can't fill up
+  // the pipes while we're busy waiting for it
+  pid_t relay = fork();
+  if (relay == -1) {
+    perror("fork");
+    return 0;
+  }
+  else if (relay == 0) {
+    close(out[1]);
+    close(err[1]);
+    relay_output(client, out[0], err[0]);
+    exit(0);
+  }
+  close(out[0]);
+  close(err[0]);
+
+  // point our own stdout and stderr at the pipes while the line runs
+  dup2(out[1], STDOUT_FILENO);
+  dup2(err[1], STDERR_FILENO);
+  close(out[1]);
+  close(err[1]);
+
+  // anything after the first line of the frame is here-document input
+  FILE *input = NULL;
+  char *nl = strchr(line, '\n');
+  if (nl != NULL) {
+    *nl = '\0';
+    input = fmemopen(nl + 1, strlen(nl + 1), "r");
+  }
+
+  int exitStatus = execute_line(line, input);
+  if (input != NULL) {
+    fclose(input);
+  }
+
+  // dropping the last write ends lets the relay see the end of the output
+  fflush(stdout);
+  fflush(stderr);
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+  dup2(devnull, STDERR_FILENO);
+  close(devnull);
+  waitpid(relay, NULL, 0);
+
+  if (frame_write_status(client, last_status) == -1) {
+    return 0;
+  }
   return exitStatus;
 }
 
+// run lines for a single client until it disconnects or exits. Each session
+// is its own process, so its working directory and variables are its own.
+// If record isn't NULL, the session's lines are recorded there.
+void serve_session(int client, const char *record) {
+  // commands don't get to read the server's stdin
+  int devnull = open("/dev/null", O_RDWR);
+  dup2(devnull, STDIN_FILENO);
+  dup2(devnull, STDOUT_FILENO);
+  dup2(devnull, STDERR_FILENO);
+  close(devnull);
+
+  if (record != NULL) {
+    recording = recording_create(record);
+    recording_started = now_us();
+  }
+
+  char *line;
+  uint32_t len;
+  int type;
+  while ((type = frame_read(client, &line, &len)) != -1) {
+    int keepGoing = 1;
+    if (type == FRAME_LINE) {
+      keepGoing = serve_line(client, line);
+    }
+    free(line);
+    if (!keepGoing) {
+      break;
+    }
+  }
+
+  close(client);
+  recording_close(recording);
+  env_delete(shell_env);
+  exit(0);
+}
+
+// listen on a Unix domain socket at the given path and serve every client
+// that connects in a session of its own. If record isn't NULL, session N
+// (counting from 1) is recorded to record.N.
+int serve(const char *path, const char *record) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    perror("socket");
+    return 1;
+  }
+  // replace a socket left behind by an earlier server
+  unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, SOMAXCONN) == -1) {
+    perror(path);
+    close(sock);
+    return 1;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = reap_sessions;
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa, NULL);
+
+  unsigned long sessions = 0;
+  while (1) {
+    int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if (client == -1) {
+      if (errno != EINTR) {
+        perror("accept");
+      }
+      continue;
+    }
+    sessions++;
+
+    pid_t pid = fork();
+    if (pid == -1) {
+      perror("fork");
+    }
+    else if (pid == 0) {
+      // sessions wait for their own children
+      signal(SIGCHLD, SIG_DFL);
+      close(sock);
+      if (record == NULL) {
+        serve_session(client, NULL);
+      }
+      else {
+        // (each session records to its own file, since a recording is
+        // written one line after another)
+        char sessionRecord[strlen(record) + 32];
+        sprintf(sessionRecord, "%s.%lu", record, sessions);
+        serve_session(client, sessionRecord);
+      }
+    }
+    close(client);
+  }
+}
+
+
 // =============================== MAIN ===============================
 
 int main(int argc, char **argv) {
-  // input buffer (initialized to the max expression length plus 1
-  // to leave room for the null terminator if the user decides to use
-  // all 255 characters)
-  char buffer[MAX_EXP_LEN + 1];
+  extern char **environ;
+  shell_env = env_new(environ);
+  run_substitution = run_command_substitution;
+
+  const char *serveSocket = NULL;
+  const char *recordFile = NULL;
+  for (int i = 1; i < argc; i += 2) {
+    if (i + 1 < argc && strcmp(argv[i], "--serve") == 0) {
+      serveSocket = argv[i + 1];
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--record") == 0) {
+      recordFile = argv[i + 1];
+    }
+    else {
+      fprintf(stderr, "Usage: %s [--serve socket-path] [--record file]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if (serveSocket != NULL) {
+    return serve(serveSocket, recordFile);
+  }
+  if (recordFile != NULL) {
+    recording = recording_create(recordFile);
+    if (recording == NULL) {
+      perror(recordFile);
+      return 1;
+    }
+  }
+
+  // input buffer (lines can be as long as they like)
+  char *buffer = NULL;
+  size_t bufferCap = 0;
 
   int exitStatus = 1;
 
-  // store the previous buffer to redo the previous command
-  char prev_buffer[MAX_EXP_LEN + 1];
-  // initialize the entire array to 0
-  memset(prev_buffer, 0, sizeof(prev_buffer));
+  // store the previous command to redo it (NULL until there is one)
+  char *prev_command = NULL;
+  // ...and what it was parsed into, here-documents and all, so running it
+  // again doesn't read anything (NULL if it didn't parse)
+  node_t *prev_script = NULL;
+
+  recording_started = now_us();
+
+  // edit lines typed at a terminal; anything else is read as it comes
+  if (isatty(STDIN_FILENO) && isatty(STDOUT_FILENO)) {
+    line_editor = lineedit_new(STDIN_FILENO, STDOUT_FILENO, complete_input);
+  }
 
   printf("Welcome to mini-shell.\n");
 
@@ -364,92 +1819,78 @@ int main(int argc, char **argv) {
       break;
     }
 
-    printf("shell $ ");
-    fflush(stdout);
-
     // wait for user input
-    int read_val = scanf("%255[^\n]", buffer);
+    ssize_t length = read_line(&buffer, &bufferCap, stdin, "shell $ ");
 
     // handle ctrl-d (EOF)
-    if (read_val == EOF) {
+    if (length == -1) {
       // end-of-file, exit
       printf("Bye bye.\n");
       break;
     }
+
     // handle no input (newline)
-    else if (read_val != 1) {
-      // no input read, consume newline and restart loop
-      getchar();
+    if (length == 0) {
       continue;
     }
 
-    // ignore any remaining characters in stdin (if the user
-    // entered more than 255)
-    int c;
-    while ((c = getchar()) != '\n' && c != EOF){}
-
-    // remove trailing whitespace from buffer and add NULL terminator
-    char *end = buffer + strlen(buffer) - 1;
-    while (end > buffer && isspace(*end)) {
-      *end-- = '\0';
-    }
-
     // ------- PROCESS USER INPUT -------
 
-    // tokenize
-    strarr_t *tokens = tokenize(buffer);
-
-    // if prev, utilize the prev_buffer, otherwise continue with
-    // the current set of commands in tokens
-    if (strcmp(tokens->data[0], "prev") == 0) {
-      if (strlen(prev_buffer) == 0) {
+    // if prev, utilize the previous command, otherwise continue with
+    // the current line
+    char *line;
+    node_t *script;
+    char *near;
+    int result;
+    if (is_prev(buffer)) {
+      if (prev_command == NULL) {
           printf("No previous command.\n");
           continue;
       }
-      strarr_delete(tokens);
-      tokens = tokenize(prev_buffer);
+      line = prev_command;
+      script = prev_script;
+      near = NULL;
+      result = PARSE_OK;
+      if (script == NULL) {
+        // (to report the same syntax error again)
+        result = parse_script(line, &script, &near);
+      }
     } 
     else {
-      strcpy(prev_buffer, buffer);
-    }
-
-    // split the line into sequenced commands and execute in order as long as
-    // the exit status is 1 (i.e., exiting in the middle of the sequence 
-    // should stop the program)
-    strarr_t *command = strarr_new(tokens->capacity);
-    unsigned int i = 0;
-    while (i < tokens->size && exitStatus == 1) {
-      if (strcmp(tokens->data[i], ";") == 0) {
-        // execute the command
-        exitStatus = execute(command);
-
-        // reset the command
-        strarr_delete(command);
-        command = strarr_new(tokens->capacity);
-      }
-      else {
-        strarr_add(command, tokens->data[i]);
+      // the line may grow to take in the lines of a compound command that
+      // it starts, and it's kept as the previous command, so it gets a
+      // buffer of its own
+      line = buffer;
+      buffer = NULL;
+      bufferCap = 0;
+      result = parse_line(&line, stdin, "> ", &script, &near);
+      free(prev_command);
+      prev_command = line;
+      node_delete(prev_script);
+      prev_script = script;
+      if (line_editor != NULL) {
+        // (without the input its here-documents read)
+        char *nl = strchr(line, '\n');
+        if (nl != NULL) {
+          *nl = '\0';
+        }
+        lineedit_history_add(line_editor, line);
+        if (nl != NULL) {
+          *nl = '\n';
+        }
       }
-      i++;
-    }
-
-    // execute the final command in the sequence (if one exits and the 
-    // status code is 1)
-    if (exitStatus == 1) {
-      exitStatus = execute(command);
     }
 
-    // ------------ CLEANUP -------------
-
-    // clear the command
-    strarr_delete(command);
-
-    // clear the tokens for the next iteration
-    strarr_delete(tokens);
-
-    // clear buffer for next iteration
-    memset(buffer, 0, sizeof(buffer));
+    // execute the sequenced commands in the line in order
+    exitStatus = run_line(line, result, script, near);
   }
 
+  free(buffer);
+  free(prev_command);
+  node_delete(prev_script);
+  lineedit_delete(line_editor);
+  complete_cache_clear();
+  recording_close(recording);
+  env_delete(shell_env);
   return 0;
 }
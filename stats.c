@@ -0,0 +1,53 @@
+/**
+ * Summary statistics (mean, standard deviation and percentiles) of samples
+ * such as latencies.
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+// qsort comparator for doubles
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const double *sorted, unsigned long count, double p) {
+  unsigned long rank = (unsigned long) ceil(p / 100.0 * count);
+  if (rank == 0) {
+    rank = 1;
+  }
+  return sorted[rank - 1];
+}
+
+/** Summarize the given samples. */
+void stats_compute(double *samples, unsigned long count, stats_t *out) {
+  memset(out, 0, sizeof(*out));
+  out->count = count;
+  if (count == 0) {
+    return;
+  }
+
+  qsort(samples, count, sizeof(double), compare_doubles);
+
+  // Welford's algorithm, which doesn't lose precision on large sums
+  double mean = 0;
+  double m2 = 0;
+  for (unsigned long i = 0; i < count; i++) {
+    double delta = samples[i] - mean;
+    mean += delta / (i + 1);
+    m2 += delta * (samples[i] - mean);
+  }
+
+  out->mean = mean;
+  out->stddev = count > 1 ? sqrt(m2 / (count - 1)) : 0;
+  out->min = samples[0];
+  out->p50 = percentile(samples, count, 50);
+  out->p90 = percentile(samples, count, 90);
+  out->p99 = percentile(samples, count, 99);
+  out->max = samples[count - 1];
+}
@@ -0,0 +1,19 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+/** Summary statistics of a set of samples. */
+typedef struct stats {
+  unsigned long count;
+  double mean;
+  double stddev;
+  double min;
+  double p50;
+  double p90;
+  double p99;
+  double max;
+} stats_t;
+
+/** Summarize the given samples. The samples are sorted in place. */
+void stats_compute(double *samples, unsigned long count, stats_t *out);
+
+#endif /* ifndef _STATS_H */
@@ -3,6 +3,8 @@
 #include <string.h>
 #include <assert.h>
 
+#include "alloc.h"
+
 // String array 
 typedef struct strarr {
   char **data;
@@ -10,6 +12,12 @@ typedef struct strarr {
   unsigned int capacity;
 } strarr_t;
 
+/* String array configuration. An array created without a capacity allocates
+ * nothing until the first element is added, and then starts with room for
+ * STRARR_INITIAL_CAPACITY elements. */
+#define STRARR_INITIAL_CAPACITY 8
+#define STRARR_GROWTH_FACTOR 2
+
 int strarr_index_of(strarr_t *arr, const char *str) {
   for (unsigned int i = 0; i < arr->size; i++) {
     if (strcmp(arr->data[i], str) == 0) {
@@ -19,14 +27,17 @@ int strarr_index_of(strarr_t *arr, const char *str) {
   return -1;
 }
 
-/** Create a new empty string array with the given capacity */
+/** Create a new empty string array with the given capacity (which may be 0) */
 strarr_t *strarr_new(unsigned int cap) {
   strarr_t *pa = (strarr_t *) malloc(sizeof(strarr_t));
   assert(pa != NULL);
   pa->size = 0;
   pa->capacity = cap;
-  pa->data = (char **) malloc(cap * sizeof(char *));
-  assert(pa->data != NULL);
+  pa->data = NULL;
+  if (cap > 0) {
+    pa->data = (char **) malloc(cap * sizeof(char *));
+    assert(pa->data != NULL);
+  }
 
   return pa;
 }
@@ -47,6 +58,19 @@ void strarr_delete(strarr_t *pa) {
   free(pa);
 }
 
+/** Make sure the array can hold at least cap elements without growing. */
+void strarr_reserve(strarr_t *pa, unsigned int cap) {
+  assert(pa != NULL);
+  if (cap <= pa->capacity) {
+    return;
+  }
+  // Reserving sizes the array exactly; it's only adding one element at a
+  // time that grows it geometrically
+  pa->data = (char **) realloc(pa->data, cap * sizeof(char *));
+  assert(pa->data != NULL);
+  pa->capacity = cap;
+}
+
 /** Retrieve the element at the given index */
 const char *strarr_get(strarr_t *pa, unsigned int idx) {
   assert(pa != NULL);
@@ -82,27 +106,56 @@ void strarr_set(strarr_t *pa, unsigned int idx, const char *elt) {
   strcpy(pa->data[idx], elt);
 }
 
-/** Add an element to the back of the vector. */
-void strarr_add(strarr_t *pa, const char *elt) {
+/** Add an element we already own to the back of the vector. The array takes
+ *  over the string (no copy is made) and frees it along with itself. */
+void strarr_take(strarr_t *pa, char *elt) {
   assert(pa != NULL);
-  assert(pa->size != pa->capacity); // make sure we're not at capacity
- 
-  // Make a copy of elt and assign it to the end of the vector
-  pa->data[pa->size] = malloc(strlen(elt) + 1);
-  strcpy(pa->data[pa->size], elt);
+
+  // If we're at capacity, grow the array by a constant factor so that
+  // adding n elements only reallocates O(log n) times
+  if (pa->size == pa->capacity) {
+    unsigned int cap = pa->capacity * STRARR_GROWTH_FACTOR;
+    strarr_reserve(pa, cap > STRARR_INITIAL_CAPACITY ? cap : STRARR_INITIAL_CAPACITY);
+  }
+
+  pa->data[pa->size] = elt;
   // Increment the size
   pa->size++;
 }
 
+/** Add an element to the back of the vector. */
+void strarr_add(strarr_t *pa, const char *elt) {
+  assert(pa != NULL);
+
+  // Make a copy of elt and hand it to the end of the vector
+  char *copy = malloc(strlen(elt) + 1);
+  assert(copy != NULL);
+  strcpy(copy, elt);
+  strarr_take(pa, copy);
+}
+
+/** Move every element of src to the back of dst and delete src. No string is
+ *  copied; dst takes them all over. */
+void strarr_adopt(strarr_t *dst, strarr_t *src) {
+  assert(dst != NULL);
+  assert(src != NULL);
+  strarr_reserve(dst, dst->size + src->size);
+  memcpy(&dst->data[dst->size], src->data, src->size * sizeof(char *));
+  dst->size += src->size;
+
+  // src no longer owns its strings, so only the array itself goes
+  free(src->data);
+  free(src);
+}
+
 /** Create a copy of the given string array. The caller is responsible
  *  for freeing the memory occupied by the copy. */
 strarr_t *strarr_copy(strarr_t *src) {
   assert(src != NULL);
-  strarr_t *copy = strarr_new(src->capacity);
+  // The copy only needs room for the elements src actually holds
+  strarr_t *copy = strarr_new(src->size);
   for (unsigned int i = 0; i < src->size; i++) {
-    char *elt_copy = strarr_get_copy(src, i);
-    strarr_add(copy, elt_copy);
-    free(elt_copy);
+    strarr_take(copy, strarr_get_copy(src, i));
   }
   return copy;
 }
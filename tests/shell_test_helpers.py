@@ -1,6 +1,8 @@
 
 from unittest import TestCase, TextTestResult
 import re
+import socket
+import struct
 import subprocess as proc
 
 TIMEOUT = 30
@@ -186,6 +188,31 @@ def execute(*args, input = None):
     else:
         return (ret, out)
 
+def recv_exactly(sock, n):
+    buf = b''
+    while len(buf) < n:
+        chunk = sock.recv(n - len(buf))
+        if not chunk:
+            raise RuntimeError("server closed the connection")
+        buf += chunk
+    return buf
+
+def serve_line(sock, line):
+    """Run a line in a `shell --serve` session.
+
+    Returns (stdout, stderr, exit status)."""
+    data = line.encode('ASCII')
+    sock.sendall(b'L' + struct.pack('>I', len(data)) + data)
+    out = {b'O': b'', b'E': b''}
+    while True:
+        header = recv_exactly(sock, 5)
+        kind, length = header[:1], struct.unpack('>I', header[1:])[0]
+        payload = recv_exactly(sock, length)
+        if kind == b'X':
+            return (try_decode(out[b'O']), try_decode(out[b'E']),
+                    struct.unpack('>i', payload)[0])
+        out[kind] += payload
+
 # inspired by https://stackoverflow.com/a/15918519
 def try_decode(bytes, codecs=['ascii', 'utf8', 'latin-1']):
     exc = None
@@ -203,9 +230,10 @@ def filter_shell_output(output):
 
     def filter_line(line):
         return re.sub(r'[Bb]ye [Bb]ye[.!]? *', '', 
-                      re.sub(r'shell ?\$ *', '', 
-                             re.sub(r'Welcome to mini-shell[.!]? *', '', 
-                                    line)))
+                      re.sub(r'^(> )+', '',
+                             re.sub(r'shell ?\$ *', '', 
+                                    re.sub(r'Welcome to mini-shell[.!]? *', '', 
+                                           line))))
 
     def is_empty(line): return line.strip() != ''
 
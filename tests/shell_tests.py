@@ -9,6 +9,12 @@ import sys
 import subprocess
 import random
 import re
+import socket
+import time
+import json
+import shutil
+import pty
+import select
 
 from shell_test_helpers import *
 
@@ -105,6 +111,386 @@ class ShellTests(ShellTestCase):
         actual = self.run_shell(script)
         self.assertEqual(actual, "one\ntwo\nthree")
 
+    def test10(self):
+        """ Variables are expanded """
+        script = \
+            "X=hello\n"\
+            'echo $X ${X}world "[$X]" [$UNSET_VARIABLE]'
+        actual = self.run_shell(script)
+        self.assertEqual(actual, "hello helloworld [hello] []")
+
+    def test11(self):
+        """ Exported variables are passed on and unset removes them """
+        script = \
+            'export GREETING="hi there"\n'\
+            "printenv GREETING\n"\
+            "unset GREETING\n"\
+            "printenv GREETING"
+        actual = self.run_shell(script)
+        self.assertEqual(actual, "hi there")
+
+    def test12(self):
+        """ Unquoted glob patterns are expanded in order """
+        sh("rm -rf tmp/glob && mkdir -p tmp/glob/sub && "
+           "touch tmp/glob/b.c tmp/glob/a.c tmp/glob/c.h tmp/glob/.hidden.c tmp/glob/sub/d.c")
+        script = \
+            "echo tmp/glob/*.c\n"\
+            "echo tmp/glob/[ab].? tmp/glob/*/*.c\n"\
+            'echo "tmp/glob/*.c" tmp/glob/*.none'
+        actual = self.run_shell(script)
+        sh("rm -rf tmp/glob")
+        self.assertEqual(actual,
+                "tmp/glob/a.c tmp/glob/b.c\n"
+                "tmp/glob/a.c tmp/glob/b.c tmp/glob/sub/d.c\n"
+                "tmp/glob/*.c tmp/glob/*.none")
+
+    def test13(self):
+        """ Pipelines work and report the exit status of their last command """
+        script = \
+            "echo one two | tr o 0 | cat\n"\
+            "echo x | false; echo $?\n"\
+            "false | true; echo $?"
+        actual = self.run_shell(script)
+        self.assertEqual(actual, "0ne tw0\n1\n0")
+
+    def test14(self):
+        """ Server mode runs isolated concurrent sessions """
+        path = os.path.abspath("tmp/shell.sock")
+        os.makedirs("tmp", exist_ok = True)
+        server = subprocess.Popen([SHELL, "--serve", path])
+        try:
+            a = socket.socket(socket.AF_UNIX)
+            b = socket.socket(socket.AF_UNIX)
+            # wait for the server to start listening
+            for _ in range(100):
+                try:
+                    a.connect(path)
+                    break
+                except (FileNotFoundError, ConnectionRefusedError):
+                    time.sleep(0.01)
+            b.connect(path)
+
+            self.assertEqual(serve_line(a, "cd /; X=a"), ("", "", 0))
+            self.assertEqual(serve_line(b, "cd tmp; X=b"), ("", "", 0))
+            self.assertEqual(serve_line(a, "pwd; echo $X"), ("/\na\n", "", 0))
+            self.assertEqual(serve_line(b, "echo $X; ls shell.sock"), ("b\nshell.sock\n", "", 0))
+
+            out, err, rc = serve_line(a, "ls /nonexistent")
+            self.assertNotEqual(err, "")
+            self.assertEqual(rc, 2)
+
+            a.close()
+            b.close()
+        finally:
+            server.kill()
+            server.wait()
+            os.remove(path)
+
+    def test15(self):
+        """ A recorded session can be replayed """
+        os.makedirs("tmp", exist_ok = True)
+        rc, _ = execute(SHELL, "--record", "tmp/session.rec",
+                        input = "echo one\nfalse\necho two\n")
+        self.assertEqual(rc, 0)
+
+        rc, report = execute("./replay", "-x", "-c", "3", "tmp/session.rec")
+        os.remove("tmp/session.rec")
+        self.assertEqual(rc, 0)
+        self.assertRegex(report, "Replayed 9 of 9 lines")
+        self.assertRegex(report, "Exit status mismatches: 0")
+
+    def test16(self):
+        """ Arithmetic expansion is evaluated in-process """
+        script = \
+            "i=5\n"\
+            "echo $((1 + 2 * 3)) $(( (i + 1) * -2 )) $((i > 3 && 1 << 4)) $((i % 2 ? 7 : 8))\n"\
+            "i=$((i + 1)); echo $i"
+        actual = self.run_shell(script)
+        self.assertEqual(actual, "7 -12 1 7\n6")
+
+    def test17(self):
+        """ Here-documents and here-strings feed the command's input """
+        script = \
+            "cat <<EOF | tr a-z A-Z; echo after\n"\
+            "first line\n"\
+            "  second line\n"\
+            "EOF\n"\
+            'wc -c <<< "hello there"'
+        actual = self.run_shell(script)
+        self.assertEqual(actual, "FIRST LINE\n  SECOND LINE\nafter\n12")
+
+    def test18(self):
+        """ Large here-documents are not limited by the line length """
+        body = "x" * 100000
+        actual = self.run_shell("wc -c <<END\n" + body + "\nEND")
+        self.assertEqual(actual, "100001")
+
+    def test19(self):
+        """ Command substitution splices the output into the command """
+        script = \
+            "echo [$(echo one two)] x$(echo a b)y \"$(echo q   r)\"\n"\
+            "echo $(echo outer $(echo inner))\n"\
+            "echo $(seq 1 100000 | wc -l) $(seq 1 50000 | tail -n 1)"
+        actual = self.run_shell(script)
+        self.assertEqual(actual, "[one two] xa by q r\nouter inner\n100000 50000")
+
+    def test20(self):
+        """ Commands are not limited in how many tokens they have """
+        os.makedirs("tmp", exist_ok = True)
+        with open("tmp/long.sh", "w") as f:
+            f.write("echo " + " ".join(str(i) for i in range(5000)) + " | wc -w\n")
+        actual = self.run_shell("source tmp/long.sh")
+        os.remove("tmp/long.sh")
+        self.assertEqual(actual, "5000")
+
+    def test21(self):
+        """ alloc-stats reports allocations, or that the profiler is built out """
+        actual = self.run_shell("echo one two\nalloc-stats")
+        self.assertRegex(actual, r"^one two\n(Live: .*\nTotal: .* over 1 lines|alloc-stats: not available)")
+
+    def test22(self):
+        """ bench runs a command repeatedly and reports its timings """
+        script = \
+            "bench -n 3 -w 1 -j cat <<END | tr a-z A-Z\n"\
+            "hi\n"\
+            "END\n"\
+            "bench -n 2 sleep 0.01"
+        actual = self.run_shell(script).splitlines()
+        self.assertEqual(actual[:4], ["HI"] * 4)
+        report = json.loads(actual[4])
+        self.assertEqual(report["command"], "cat << ... | tr a-z A-Z")
+        self.assertEqual((report["runs"], report["warmup"], report["status"]), (3, 1, 0))
+        self.assertLessEqual(report["wall_ms"]["min"], report["wall_ms"]["p50"])
+        self.assertEqual(actual[5], "2 runs of sleep 0.01 (after 1 warmup), times in ms:")
+        self.assertGreaterEqual(float(actual[7].split()[3]), 10.0)
+
+    def test23(self):
+        """ Output can be appended, split from errors and sent to several places """
+        shutil.rmtree("tmp/out", ignore_errors = True)
+        os.makedirs("tmp/out")
+        script = \
+            "echo one > tmp/out/a; echo two >> tmp/out/a\n"\
+            "ls tmp/out/missing 2> tmp/out/err; echo $?\n"\
+            "ls tmp/out/a tmp/out/missing > tmp/out/both 2>&1\n"\
+            "seq 1 100000 > tmp/out/b > tmp/out/c | wc -l\n"\
+            "ls tmp/out/missing > tmp/out/d 2>&1 > tmp/out/e\n"\
+            "cat tmp/out/a; cat tmp/out/err | wc -l; cat tmp/out/both | wc -l; cat tmp/out/b tmp/out/c | wc -l\n"\
+            "cat tmp/out/d | wc -l; cat tmp/out/e | wc -l"
+        actual = self.run_shell(script)
+        shutil.rmtree("tmp/out")
+        self.assertEqual(actual, "2\n100000\none\ntwo\n1\n2\n200000\n1\n0")
+
+    def test24(self):
+        """ if, while and for run in the shell, over one line or several """
+        os.makedirs("tmp", exist_ok = True)
+        with open("tmp/loop.sh", "w") as f:
+            f.write("for x in a \"b c\" $(echo d); do\n"
+                    "  if test \"$x\" = d; then\n"
+                    "    echo last $x\n"
+                    "  elif test \"$x\" = a; then echo first $x\n"
+                    "  else\n"
+                    "    echo [$x]\n"
+                    "  fi\n"
+                    "done\n")
+        script = \
+            "source tmp/loop.sh\n"\
+            "i=0; while test $i -lt 3; do echo $i; i=$((i + 1)); done; echo $? $i\n"\
+            "if false; then echo no\n"\
+            "else echo yes; fi\n"\
+            "for x in 1 2 3; do if test $x = 2; then exit; fi; echo $x; done\n"\
+            "echo not reached"
+        actual = self.run_shell(script)
+        os.remove("tmp/loop.sh")
+        self.assertEqual(actual, "first a\n[b c]\nlast d\n0\n1\n2\n0 3\nyes\n1")
+
+    def test25(self):
+        """ Malformed control flow is a syntax error """
+        script = \
+            "if true; then fi; echo $?\n"\
+            "echo $?\n"\
+            "for 1 in a; do echo; done\n"\
+            "while true; do echo x"
+        actual = self.run_shell(script)
+        self.assertEqual(actual,
+                "syntax error near 'fi'\n2\n"
+                "syntax error near '1'\n"
+                "syntax error: unexpected end of input")
+
+    def test26(self):
+        """ Lines typed at a terminal can be edited, recalled and tab completed """
+        shutil.rmtree("tmp/comp", ignore_errors = True)
+        os.makedirs("tmp/comp/bin")
+        open("tmp/comp/file.txt", "w").close()
+        with open("tmp/comp/bin/zzqtool", "w") as f:
+            f.write("#!/bin/sh\necho tool ran\n")
+        os.chmod("tmp/comp/bin/zzqtool", 0o755)
+
+        pid, fd = pty.fork()
+        if pid == 0:
+            os.environ["PATH"] = os.path.abspath("tmp/comp/bin") + ":" + os.environ["PATH"]
+            os.execv(SHELL, [SHELL])
+
+        output = b""
+        def type_keys(keys):
+            nonlocal output
+            os.write(fd, keys.encode())
+            while select.select([fd], [], [], 0.3)[0]:
+                try:
+                    output += os.read(fd, 65536)
+                except OSError:
+                    break
+
+        try:
+            type_keys("zzq\t\r")
+            type_keys("echo tmp/comp/fi\t\r")
+            type_keys("\x1b[A\x1b[D\x1b[D\x1b[D\x1b[D\x0b.txt!\r")
+            # a new program turns up once its directory has changed
+            with open("tmp/comp/bin/zzqother", "w") as f:
+                f.write("#!/bin/sh\n")
+            os.chmod("tmp/comp/bin/zzqother", 0o755)
+            type_keys("zzq\t\t")
+            type_keys("\x03\x04")
+        finally:
+            os.waitpid(pid, 0)
+            os.close(fd)
+            shutil.rmtree("tmp/comp")
+
+        lines = [line.split("\r")[-1] for line in try_decode(output).split("\r\n")]
+        self.assertIn("tool ran", lines)
+        self.assertIn("tmp/comp/file.txt", lines)
+        self.assertIn("tmp/comp/file.txt!", lines)
+        self.assertIn("zzqother  zzqtool", lines)
+        self.assertIn("Bye bye.", lines)
+
+    def test27(self):
+        """ Every word an unquoted substitution splits into is glob expanded """
+        shutil.rmtree("tmp/split", ignore_errors = True)
+        os.makedirs("tmp/split")
+        for name in ["a.c", "b.c", "c.h"]:
+            open("tmp/split/" + name, "w").close()
+        script = \
+            'echo $(echo "tmp/split/*.c tmp/split/*.h")\n'\
+            'echo "$(echo "tmp/split/*.c")" $(echo "tmp/split/*.none x")'
+        actual = self.run_shell(script)
+        shutil.rmtree("tmp/split")
+        self.assertEqual(actual,
+                "tmp/split/a.c tmp/split/b.c tmp/split/c.h\n"
+                "tmp/split/*.c tmp/split/*.none x")
+
+    def test28(self):
+        """ Here-documents in a loop spread over several lines feed every iteration """
+        script = \
+            "for x in 1 2 3; do\n"\
+            "  cat <<EOF | tr a-z A-Z\n"\
+            "body\n"\
+            "EOF\n"\
+            "  echo $x\n"\
+            "done\n"\
+            "i=0; while test $i -lt 2; do\n"\
+            "  wc -l <<A; i=$((i + 1))\n"\
+            "one\n"\
+            "two\n"\
+            "A\n"\
+            "done; echo end"
+        actual = self.run_shell(script)
+        self.assertEqual(actual, "BODY\n1\nBODY\n2\nBODY\n3\n2\n2\nend")
+
+    def test29(self):
+        """ prev runs a here-document again without reading more input """
+        script = \
+            "cat <<EOF | tr a-z A-Z\n"\
+            "hello\n"\
+            "EOF\n"\
+            "prev\n"\
+            "echo done"
+        actual = self.run_shell(script)
+        self.assertEqual(actual, "HELLO\nHELLO\ndone")
+
+    def test30(self):
+        """ Replaying a recording feeds here-documents and sourced lines the same way """
+        os.makedirs("tmp", exist_ok = True)
+        with open("tmp/replay.sh", "w") as f:
+            f.write("echo sourced >> tmp/replay.out\n")
+        rc, _ = execute(SHELL, "--record", "tmp/replay.rec",
+                        input = "cat <<EOF | tr a-z A-Z > tmp/replay.out\n"
+                                "hello\n"
+                                "  there\n"
+                                "EOF\n"
+                                "source tmp/replay.sh\n")
+        self.assertEqual(rc, 0)
+        with open("tmp/replay.out") as f:
+            original = f.read()
+        os.remove("tmp/replay.out")
+
+        rc, report = execute("./replay", "-x", "tmp/replay.rec")
+        with open("tmp/replay.out") as f:
+            replayed = f.read()
+        for name in ("replay.sh", "replay.rec", "replay.out"):
+            os.remove("tmp/" + name)
+        self.assertEqual(rc, 0)
+        self.assertRegex(report, "Replayed 2 of 2 lines")
+        self.assertRegex(report, "Exit status mismatches: 0")
+        self.assertEqual(original, "HELLO\n  THERE\nsourced\n")
+        self.assertEqual(replayed, original)
+
+    def test31(self):
+        """ A substitution in a sourced file doesn't make the shell read its input again """
+        os.makedirs("tmp", exist_ok = True)
+        with open("tmp/subst.sh", "w") as f:
+            f.write("echo [$(echo hi)]\necho [$(exit)]\n")
+        with open("tmp/subst.in", "w") as f:
+            f.write("echo $(echo first)\nsource tmp/subst.sh\necho one\n")
+        with open("tmp/subst.in") as f:
+            exe = subprocess.run(SHELL, stdin = f, stdout = subprocess.PIPE,
+                                 stderr = subprocess.STDOUT, timeout = 30)
+        os.remove("tmp/subst.sh")
+        os.remove("tmp/subst.in")
+        output = try_decode(exe.stdout)
+        self.assertEqual(exe.returncode, 0)
+        self.assertNotIn("[Bye", output)
+        self.assertEqual(filter_shell_output(output), "first\n[hi]\n[]\none")
+
+    def test32(self):
+        """ Fanning output out doesn't make the shell read its input again """
+        os.makedirs("tmp", exist_ok = True)
+        with open("tmp/fanout.in", "w") as f:
+            f.write("echo a > tmp/fanout1 > tmp/fanout2\nnosuchcmd\necho one\n")
+        with open("tmp/fanout.in") as f:
+            exe = subprocess.run(SHELL, stdin = f, stdout = subprocess.PIPE,
+                                 stderr = subprocess.STDOUT, timeout = 30)
+        with open("tmp/fanout1") as f1, open("tmp/fanout2") as f2:
+            copies = f1.read() + f2.read()
+        for name in ("fanout.in", "fanout1", "fanout2"):
+            os.remove("tmp/" + name)
+        self.assertEqual(exe.returncode, 0)
+        self.assertEqual(copies, "a\na\n")
+        self.assertEqual(filter_shell_output(try_decode(exe.stdout)),
+                         "nosuchcmd: command not found\none")
+
+    def test33(self):
+        """ Only an unquoted << starts a here-document """
+        script = \
+            'echo "<<" x\n'\
+            "echo after\n"\
+            'cat <<"EOF" | tr a-z A-Z\n'\
+            "quoted delimiter\n"\
+            "EOF\n"\
+            "echo ignored | cat <<EOF\n"\
+            "second command\n"\
+            "EOF"
+        actual = self.run_shell(script)
+        self.assertEqual(actual, "<< x\nafter\nQUOTED DELIMITER\nsecond command")
+
+    def test34(self):
+        """ for splits unquoted variables into words, other commands don't """
+        script = \
+            'X="a  b"\n'\
+            "for w in $X c$X; do echo [$w]; done\n"\
+            'for w in "$X"; do echo [$w]; done\n'\
+            "echo [$X]"
+        actual = self.run_shell(script)
+        self.assertEqual(actual, "[a]\n[b]\n[ca]\n[b]\n[a  b]\n[a  b]")
+
 if __name__ == '__main__':
     print(f"-= {YELLOW}Running tests for {SHELL}{RESET} =-")
     unittest.main(testRunner = unittest.TextTestRunner(resultclass = PrettierTextTestResult))
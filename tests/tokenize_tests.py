@@ -50,6 +50,33 @@ class ShellTests(ShellTestCase):
                 "foo\nLorem ipsum dolor sit amet\n<\nbar\nconsectetur (adipiscing; >elit")
 
 
+    def test07(self):
+        """Recognizes here-document and here-string operators"""
+        self.assertEqual(sh("echo 'cat <<EOF <<< x < y' | ./tokenize"), "cat\n<<\nEOF\n<<<\nx\n<\ny")
+
+    def test08(self):
+        """Tokenizes every line of a stream, however long"""
+        lines = "".join(f"echo {'x' * i}; ls\n" for i in range(1, 2001))
+        out = subprocess.run([TOKENIZE, "-q"], input = lines.encode(), capture_output = True).stdout
+        tokens = try_decode(out).splitlines()
+        self.assertEqual(len(tokens), 2000 * 4)
+        self.assertEqual(tokens[-4:], ["echo", "x" * 2000, ";", "ls"])
+
+    def test09(self):
+        """Writes JSON lines and length-prefixed binary output"""
+        self.assertEqual(
+                sh("printf 'a \"b \\\\ c\"\\n\\nd\\n' | ./tokenize -q -f json"),
+                '["a","b \\\\ c"]\n[]\n["d"]')
+        out = subprocess.run([TOKENIZE, "-q", "-f", "binary"], input = b"ab | c\n\n",
+                             capture_output = True).stdout
+        self.assertEqual(out, b"\x03\x02ab\x01|\x01c\x00")
+
+    def test10(self):
+        """Recognizes output redirection operators"""
+        self.assertEqual(
+                sh("echo 'a >> b 2> c 2>> d 2>&1 x2>y' | ./tokenize -q"),
+                "a\n>>\nb\n2>\nc\n2>>\nd\n2>&1\nx2\n>\ny")
+
 
 if __name__ == '__main__':
     print(f"-= {YELLOW}Running tests for {TOKENIZE}{RESET} =-")
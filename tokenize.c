@@ -1,24 +1,291 @@
+/**
+ * Tokenizes a stream of shell input line by line and writes out the tokens
+ * of each line, as plain text (one token per line), JSON lines (an array of
+ * tokens per input line) or a compact binary format (per input line, a
+ * varint token count followed by each token as a varint length and its
+ * bytes; varints are unsigned LEB128).
+ *
+ * Output is gathered into batches of iovecs that point straight at the
+ * tokens and written with a single writev per batch. Throughput is reported
+ * on stderr at exit.
+ */
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
+
 #include "parse.h"
 
+// ============================= CONSTANTS =============================
+
+// Number of iovecs written per writev call (at most IOV_MAX)
+#define BATCH_IOVS 1024
+
+enum format { FORMAT_TEXT, FORMAT_JSON, FORMAT_BINARY };
+
+// ============================== HELPERS ==============================
+
+// Output waiting to be written
+typedef struct batch {
+  struct iovec iov[BATCH_IOVS];
+  int count;
+  // varints the iovecs point into (at most one per iovec)
+  unsigned char varints[BATCH_IOVS][5];
+  // tokens the iovecs point into; freed once they're written
+  strarr_t *held;
+} batch_t;
+
+// print usage information
+void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-f text|json|binary] [-q] [file ...]\n", prog);
+  fprintf(stderr, "  -f format  output format (default text)\n");
+  fprintf(stderr, "  -q         don't report throughput on exit\n");
+}
+
+// seconds elapsed on a monotonic clock
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// write out everything in the batch and start a new one
+// returns 0 on success, -1 on error
+int batch_flush(batch_t *b) {
+  struct iovec *iov = b->iov;
+  int count = b->count;
+  while (count > 0) {
+    ssize_t n = writev(STDOUT_FILENO, iov, count);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      return -1;
+    }
+    // skip over whatever was written (a short write can end mid-iovec)
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  b->count = 0;
+  strarr_delete(b->held);
+  b->held = strarr_new(0);
+  return 0;
+}
+
+// add len bytes at data to the batch (data must stay put until the next flush)
+// returns 0 on success, -1 on error
+int batch_add(batch_t *b, const void *data, size_t len) {
+  if (b->count == BATCH_IOVS && batch_flush(b) == -1) {
+    return -1;
+  }
+  b->iov[b->count].iov_base = (void *)data;
+  b->iov[b->count].iov_len = len;
+  b->count++;
+  return 0;
+}
+
+// add an unsigned varint to the batch
+// returns 0 on success, -1 on error
+int batch_add_varint(batch_t *b, uint32_t value) {
+  if (b->count == BATCH_IOVS && batch_flush(b) == -1) {
+    return -1;
+  }
+  unsigned char *p = b->varints[b->count];
+  size_t len = 0;
+  do {
+    p[len] = value & 0x7f;
+    value >>= 7;
+    if (value) {
+      p[len] |= 0x80;
+    }
+    len++;
+  } while (value);
+  return batch_add(b, p, len);
+}
+
+// Get a copy of the token as the contents of a JSON string, or NULL if it
+// can go in as it is
+char *json_escape(const char *token) {
+  size_t i = 0;
+  while (token[i] != '\0' && token[i] != '"' && token[i] != '\\' && (unsigned char)token[i] >= 0x20) {
+    i++;
+  }
+  if (token[i] == '\0') {
+    return NULL;
+  }
+
+  wordbuf_t escaped = { NULL, 0, 0 };
+  wordbuf_append(&escaped, token, i);
+  for (; token[i] != '\0'; i++) {
+    unsigned char c = token[i];
+    if (c == '"' || c == '\\') {
+      char pair[2] = { '\\', c };
+      wordbuf_append(&escaped, pair, 2);
+    }
+    else if (c < 0x20) {
+      char hex[8];
+      int n = snprintf(hex, sizeof(hex), "\\u%04x", c);
+      wordbuf_append(&escaped, hex, n);
+    }
+    else {
+      wordbuf_append(&escaped, &token[i], 1);
+    }
+  }
+  return escaped.data;
+}
+
+// add the tokens of one input line to the batch in the given format; the
+// batch takes the tokens over
+// returns 0 on success, -1 on error
+int batch_add_line(batch_t *b, strarr_t *tokens, enum format format) {
+  int result = 0;
+  if (format == FORMAT_BINARY) {
+    result = batch_add_varint(b, tokens->size);
+  }
+  else if (format == FORMAT_JSON && tokens->size == 0) {
+    result = batch_add(b, "[]\n", 3);
+  }
+
+  for (unsigned int i = 0; result == 0 && i < tokens->size; i++) {
+    const char *token = tokens->data[i];
+    if (format == FORMAT_TEXT) {
+      result = batch_add(b, token, strlen(token));
+      if (result == 0) {
+        result = batch_add(b, "\n", 1);
+      }
+    }
+    else if (format == FORMAT_JSON) {
+      char *escaped = json_escape(token);
+      if (escaped != NULL) {
+        token = escaped;
+      }
+      result = batch_add(b, i == 0 ? "[\"" : "\",\"", i == 0 ? 2 : 3);
+      if (result == 0) {
+        result = batch_add(b, token, strlen(token));
+      }
+      // (held only now, so that a flush above can't free it too early)
+      if (escaped != NULL) {
+        strarr_take(b->held, escaped);
+      }
+      if (result == 0 && i == tokens->size - 1) {
+        result = batch_add(b, "\"]\n", 3);
+      }
+    }
+    else {
+      size_t len = strlen(token);
+      result = batch_add_varint(b, len);
+      if (result == 0) {
+        result = batch_add(b, token, len);
+      }
+    }
+  }
+
+  // the iovecs point into the tokens, so keep them until they're written
+  strarr_adopt(b->held, tokens);
+  return result;
+}
+
 // =============================== MAIN ==============================
 
 int main(int argc, char **argv) {
-  
-  char buffer[256];
-  int total_bytes = read(0, buffer, 255);  
-  buffer[total_bytes] = '\0';
-  close(0);
+  enum format format = FORMAT_TEXT;
+  int quiet = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:q")) != -1) {
+    switch (opt) {
+      case 'f':
+        if (strcmp(optarg, "text") == 0) {
+          format = FORMAT_TEXT;
+        }
+        else if (strcmp(optarg, "json") == 0) {
+          format = FORMAT_JSON;
+        }
+        else if (strcmp(optarg, "binary") == 0) {
+          format = FORMAT_BINARY;
+        }
+        else {
+          usage(argv[0]);
+          return 2;
+        }
+        break;
+      case 'q':
+        quiet = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+
+  batch_t *batch = (batch_t *)malloc(sizeof(batch_t));
+  assert(batch != NULL);
+  batch->count = 0;
+  batch->held = strarr_new(0);
+
+  unsigned long long numTokens = 0;
+  unsigned long long numBytes = 0;
+  unsigned long long numLines = 0;
+  int exitStatus = 0;
+  double started = now();
 
-  // Takes buffer as expr
-  strarr_t *tokens = tokenize(buffer);
+  // read standard input if no files are given
+  int numFiles = argc - optind;
+  for (int f = 0; f < (numFiles ? numFiles : 1) && exitStatus == 0; f++) {
+    FILE *input = stdin;
+    if (numFiles) {
+      input = fopen(argv[optind + f], "r");
+      if (input == NULL) {
+        perror(argv[optind + f]);
+        exitStatus = 1;
+        break;
+      }
+    }
 
-  int i = 0;
-  while (i < tokens->size) {
-    printf("%s\n", tokens->data[i]);
-    ++i;
+    // lines can be as long as they like
+    char *line = NULL;
+    size_t lineCap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &lineCap, input)) != -1) {
+      strarr_t *tokens = tokenize(line);
+      numBytes += n;
+      numTokens += tokens->size;
+      numLines++;
+      if (batch_add_line(batch, tokens, format) == -1) {
+        perror("write");
+        exitStatus = 1;
+        break;
+      }
+    }
+    free(line);
+
+    if (input != stdin) {
+      fclose(input);
+    }
   }
 
-  strarr_delete(tokens);
+  if (exitStatus == 0 && batch_flush(batch) == -1) {
+    perror("write");
+    exitStatus = 1;
+  }
+  strarr_delete(batch->held);
+  free(batch);
 
-  return 0;
+  if (!quiet) {
+    double elapsed = now() - started;
+    if (elapsed <= 0) {
+      elapsed = 1e-9;
+    }
+    fprintf(stderr, "%llu lines, %llu tokens, %llu bytes in %.3f s: %.0f tokens/s, %.0f bytes/s\n",
+            numLines, numTokens, numBytes, elapsed, numTokens / elapsed, numBytes / elapsed);
+  }
+
+  return exitStatus;
 }
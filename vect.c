@@ -14,6 +14,7 @@
 #include <string.h>
 
 #include "vect.h"
+#include "alloc.h"
 
 /** Main data structure for the vector. */
 struct vect {